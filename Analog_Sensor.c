@@ -11,9 +11,13 @@
 #include <avr/pgmspace.h>
 #include <stddef.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include "sensor_core.h"			//calibration, queue, endpoints, encoders: shared with the host tools
 
 // PINB0 key pin on GSM (active low output)
 // PINB1 resistor sensor enable (active low output)
@@ -33,7 +37,7 @@
 #define OV_DETECT11 (1<<PINB3)		//used for masking (this is input pin)
 #define OV_DETECT22 (1<<PINB4)
 
-//UART receive byte definitions; A-I in ascii
+//UART receive byte definitions; A-Q in ascii.  See command dispatch for the arguments
 #define LIGHT_1_CTRL_ON			0x41	//A
 #define LIGHT_1_CTRL_OFF		0x42	//B	
 #define LIGHT_2_CTRL_ON			0x43	//C
@@ -45,6 +49,12 @@
 #define LIGHT_1_RES_REQ			0x49	//I  if one of these bytes are received with a light identifier do appropriate action
 #define LIGHT_2_RES_REQ			0x4A	//J
 #define LIGHTS_RES_REQ			0x4B	//K if this byte is received, send a resistance measurement from both lights
+#define DIAG_REQ				0x4C	//L [<name> ...|all] text back RAM/stack, or the named diagnostics (cmd_diag())
+#define CAPTURE_1_REQ			0x4D	//M burst-capture pole 1 and upload the waveform
+#define CAPTURE_2_REQ			0x4E	//N burst-capture pole 2 and upload the waveform
+#define SAMPLE_REQ				0x4F	//O<pole> <min_s> <max_s> set a pole's sampling interval bounds
+#define REPORT_REQ				0x50	//P<pole> <every_s> [<phase_s> [<from_h>-<to_h>]] set a pole's report schedule
+#define ENERGY_REQ				0x51	//Q[<state> <uA>] set the current drawn in a power state, text back all of them
 
 
 //used for setting clock speed
@@ -59,6 +69,8 @@
 #define CPU_125kHz      0x07
 #define CPU_62kHz       0x08
 #define BAUD	103					//baud rate of 9600: determined from data sheet
+#define BENCH_BAUD	0				//1: at boot, time AT commands at every baud rate and text the results
+#define BENCH_CMD	0				//1: at boot, time parse-to-pin of each light command and text the results
 
 const char pole_1[] = "POLE1";	//pole identifiers; send before sending data
 const char pole_2[] = "POLE2";
@@ -72,17 +84,9 @@ const char text_mode[] = "AT+CMGF=1";	//to set text mode
 const char full_text[] = "AT+CSDH=1";	//to display full text information
 const char delete_all[] = "AT+CMGDA=\"DEL ALL\"";	//to delete all text
 const char no_echo[] = "ATE0";		//turn off echo
-const char reg_1[] = "AT+CMGR=1";	//to access register 1 text
 const char num_cmd[] = "AT+CMGS=";	//phone number should follower this string
 const char num[] = "\"15412559226\"";//phone number to send text to
-const char ip_stat1[] = "67.169.210.201:3000/update1";
-const char ip_stat2[] = "67.169.210.201:3000/update2";
-const char ip_data1[] = "67.169.210.201:3000/data1";
-const char ip_data2[] = "67.169.210.201:3000/data2";
-const char ip_initstat1[] = "67.169.210.201:3000/light1";			//use on start up, don't use again
-const char ip_initstat2[] = "67.169.210.201:3000/light2";			//use on strat up, don't use again
-const char ip_bad_contact1[] = "67.169.210.201:3000/update1conctact";			//send a zero ascii;
-const char ip_bad_contact2[] = "67.169.210.201:3000/update2conctact";			//send a zero ascii;
+const char server[] = "67.169.210.201:3000";		//endpoint paths are in sensor_core.h
 const char con_gprs[] = "AT+SAPBR=3,1,Contype,GPRS";
 const char apn[] = "AT+SAPBR=3,1,APN,WHOLESALE";
 const char en_gprs[] = "AT+SAPBR=1,1";
@@ -90,15 +94,18 @@ const char con_test[] = "AT+SAPBR=2,1";		//may not need
 const char en_http[] = "AT+HTTPINIT";
 const char set_profile[] = "AT+HTTPPARA=CID,1";
 const char url[] = "AT+HTTPPARA=URL,";	//Tx ip_x after this
-const char data_config[] = "AT+HTTPDATA=8,1500";
-const char post[] = "AT+HTTPACTION=1";
 
 const uint8_t carr_rtn = 0x0D;		//must use after every command
 const uint8_t ctrl_z = 0x1A;		//after data entry when sending sms
 
 uint8_t flag = 0;					//recieve status (when ISR(receive_vector) is processed then flag gets set)										//should reset flag in main after designed routine is processed
-char data_received[1000];			//control word received from GSM--used to determine case for switch statement (state machine)
+char data_received[257];			//control word received from GSM--used to determine case for switch statement (state machine)
+									//ind is 8 bits so the ISR never writes past [256]; see tools/sram_budget.txt
 uint8_t ind = 0;					//used for indexing through array in ISR
+uint8_t line_at = 0;				//where the line the ISR is receiving started
+volatile uint32_t sms_new = 0;		//bit n-1: +CMTI reported a text at index n (1-32), latched by the ISR
+uint32_t sms_done = 0;				//bit n-1: the text at index n has been run, for cmd_cleanup_poll()
+volatile uint16_t http_result = 0;	//status from the last +HTTPACTION notification, latched by the ISR
 uint32_t count = 0;					//used for the delay_functions described below
 char data_ascii[8];					//used to send data in character form
 uint8_t one_shot = 0;
@@ -166,6 +173,222 @@ void delay_10m()
 
 
 
+/********************************system tick*************************************/
+/********************************************************************************/
+//Timer0 in CTC mode at 1kHz: 16MHz/64/250.  Used for response timeouts and timing,
+//the delay_ functions above are still used for the fixed waits.
+volatile uint32_t ms_ticks = 0;
+volatile uint32_t uptime_s = 0;			//whole seconds since reset, never wraps in practice
+uint16_t ms_sub = 0;
+
+void init_systick()
+{
+	TCCR0A = (1<<WGM01);				//CTC, top = OCR0A
+	TCCR0B = (1<<CS01)|(1<<CS00);		//clk/64
+	OCR0A = 249;
+	TIMSK0 = (1<<OCIE0A);
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+	ms_ticks++;
+	if (++ms_sub >= 1000)
+	{
+		ms_sub = 0;
+		uptime_s++;
+	}
+}
+
+uint32_t uptime()
+{
+	uint32_t s;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		s = uptime_s;
+	}
+	return s;
+}
+
+uint32_t millis()
+{
+	uint32_t ms;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ms = ms_ticks;
+	}
+	return ms;
+}
+
+uint32_t idle_us = 0;			//slept in cpu_idle(), for the energy accounting
+
+//sleep until the next interrupt (a systick at most); timers, UART and ADC keep running.
+//Timer3 (see command dispatch) times it.  Never with interrupts off: nothing would wake it
+void cpu_idle()
+{
+	uint16_t t0 = TCNT3;
+	
+	if (!(SREG & (1<<SREG_I)))
+	{
+		return;
+	}
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+	idle_us += (uint16_t)(TCNT3 - t0) / 2;
+}
+
+void delay_ms(uint16_t ms)
+{
+	uint32_t start = millis();
+	while (millis() - start < ms)
+	{
+		cpu_idle();
+	}
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+
+/********************************device clock************************************/
+/********************************************************************************/
+//UTC from the network (AT+CCLK?, see clock_sync()) anchored to uptime, so reading the
+//time never needs the modem.  Queued samples and events carry a 2 byte stamp, the
+//uptime second they were queued, which clock_epoch_at() turns into UTC when they go out.
+uint32_t clock_anchor_epoch = 0;		//UTC seconds at clock_anchor_up; 0 until the first sync
+uint32_t clock_anchor_up = 0;
+
+uint16_t clock_stamp()
+{
+	return (uint16_t)uptime();
+}
+
+//seconds since a stamp was taken (stamps are only good for 18 hours)
+uint16_t clock_age(uint16_t stamp)
+{
+	return (uint16_t)uptime() - stamp;
+}
+
+//UTC for a stamp, 0 if the clock has never synced
+uint32_t clock_epoch_at(uint16_t stamp)
+{
+	if (!clock_anchor_epoch)
+	{
+		return 0;
+	}
+	return clock_anchor_epoch + (uptime() - clock_anchor_up) - clock_age(stamp);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************energy accounting*********************************/
+/********************************************************************************/
+//time in each power state (sensor_core.h) is gathered here: wall time goes to the
+//modem's state and to the MCU (active, less what cpu_idle() slept), ADC conversions and
+//UART bytes are counted and turned into time.  energy_sync() folds it all in; it runs
+//every second and whenever the modem changes state.  Currents can be set by SMS Q and
+//are kept in EEPROM.
+struct energy energy;
+uint32_t ee_pwr_ua[PWR_STATES] EEMEM;
+uint8_t pwr_modem = PWR_MODEM;			//state the modem is drawing in
+uint32_t energy_at = 0;					//millis() of the last sync
+uint16_t tx_bytes = 0;
+volatile uint16_t rx_bytes = 0;
+volatile uint16_t adc_conversions = 0;
+
+void init_energy()
+{
+	uint32_t ua;
+	uint8_t s;
+	
+	energy_init(&energy);
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		ua = eeprom_read_dword(&ee_pwr_ua[s]);
+		if (ua <= PWR_UA_MAX)			//0xFFFFFFFF: never set
+		{
+			energy.ua[s] = ua;
+		}
+	}
+	energy_at = millis();
+}
+
+void energy_sync()
+{
+	uint32_t now = millis();
+	uint32_t ms = now - energy_at;
+	uint32_t us;
+	uint32_t idle;
+	uint16_t byte_us = 10 * (UBRR1 + 1);			//10 bits at 16MHz/16/(UBRR1+1)
+	uint16_t adc;
+	uint16_t rx;
+	
+	if (UCSR1A & (1<<U2X1))
+	{
+		byte_us /= 2;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		adc = adc_conversions;
+		adc_conversions = 0;
+		rx = rx_bytes;
+		rx_bytes = 0;
+	}
+	while (ms)						//a long gap (a blocking wait) in steps, so ms * 1000 can't wrap
+	{
+		us = (ms < ENERGY_STEP_MS ? ms : ENERGY_STEP_MS) * 1000;
+		idle = idle_us < us ? idle_us : us;
+		energy_add(&energy, pwr_modem, us);
+		energy_add(&energy, PWR_ACTIVE, us - idle);
+		energy_add(&energy, PWR_IDLE, idle);
+		idle_us -= idle;
+		ms -= us / 1000;
+	}
+	energy_add(&energy, PWR_ADC, (uint32_t)adc * ADC_CONV_US);
+	energy_add(&energy, PWR_TX, (uint32_t)tx_bytes * byte_us);
+	energy_add(&energy, PWR_RX, (uint32_t)rx * byte_us);
+	energy_at = now;
+	idle_us = 0;
+	tx_bytes = 0;
+	energy_charge(&energy);
+}
+
+//the modem starts drawing as state (PWR_MODEM, PWR_MODEM_SLEEP or PWR_GPRS)
+void energy_modem(uint8_t state)
+{
+	if (state != pwr_modem)
+	{
+		energy_sync();
+		pwr_modem = state;
+	}
+}
+
+void energy_poll()
+{
+	if (millis() - energy_at >= 1000)
+	{
+		energy_sync();
+	}
+}
+
+void op_begin(uint8_t op)
+{
+	energy_sync();
+	energy_begin(&energy, op, 1);
+}
+
+void op_end(uint8_t op)
+{
+	energy_sync();
+	energy_end(&energy, op);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+
 /*****************************Configure IO **************************************/
 /********************************************************************************/
 /********************************************************************************/
@@ -181,12 +404,83 @@ void delay_10m()
 /********************************************************************************/
 /********************************************************************************/
 
+/*****************************light state**************************************/
+/********************************************************************************/
+//the commanded light state is kept in EEPROM so a reset (brownout, watchdog) puts the
+//lights back before anything else runs.  It is a log of LIGHT_LOG one byte records,
+//<6 bit sequence><light 2 on><light 1 on>, written round the log so each cell takes
+//1/LIGHT_LOG of the writes, and only when the state changes.  The newest record is the
+//last one whose sequence follows on from the one before it, starting at cell 0.  Erased
+//EEPROM reads as both lights on, the same as before this was kept.
+#define LIGHT_LOG		16
+#define LIGHT_1			0x01
+#define LIGHT_2			0x02
+#define LIGHT_SEQ(r)	((r) >> 2)
+
+uint8_t ee_light[LIGHT_LOG] EEMEM;
+uint8_t light_cell;				//cell the newest record is in
+uint8_t light_rec;				//and what it says
+
+void light_load()
+{
+	uint8_t next;
+	
+	light_cell = 0;
+	light_rec = eeprom_read_byte(&ee_light[0]);
+	while (light_cell < LIGHT_LOG - 1)
+	{
+		next = eeprom_read_byte(&ee_light[light_cell + 1]);
+		if (LIGHT_SEQ(next) != ((LIGHT_SEQ(light_rec) + 1) & 0x3F))
+		{
+			break;
+		}
+		light_cell++;
+		light_rec = next;
+	}
+}
+
+//LIGHT_1/LIGHT_2 bits for the lights that are on now
+uint8_t light_state()
+{
+	return (PORTB & CTRL_1 ? 0 : LIGHT_1) | (PORTB & CTRL_2 ? 0 : LIGHT_2);
+}
+
+//record the lights as they are now, if that's not what's recorded already
+void light_save()
+{
+	uint8_t state = light_state();
+	
+	if (state == (light_rec & (LIGHT_1 | LIGHT_2)))
+	{
+		return;
+	}
+	light_cell = (light_cell + 1) % LIGHT_LOG;
+	light_rec = ((LIGHT_SEQ(light_rec) + 1) & 0x3F) << 2 | state;
+	eeprom_update_byte(&ee_light[light_cell], light_rec);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
 /*****************************digital IO*****************************************/
 /********************************************************************************/
+//PINB5 is DTR to the modem (see modem power).  The lights come up as last recorded;
+//PORTB is set before DDRB so they never glitch to the reset value on the way
 void init_dio()
 {
+	uint8_t port = GSM_ON;
+	
+	light_load();
+	if (!(light_rec & LIGHT_1))
+	{
+		port |= CTRL_1;				//off
+	}
+	if (!(light_rec & LIGHT_2))
+	{
+		port |= CTRL_2;
+	}
+	PORTB = port;									//1-->high, 0-->low	
 	DDRB = 0b11100111;				//1-->output, 0-->input
-	PORTB = GSM_ON;									//1-->high, 0-->low	
 }
 
 /********************************************************************************/
@@ -294,6 +588,7 @@ void Tx_USART(uint8_t data)
 	//wait for empty transmit buffer
 	while(!(UCSR1A & (1<<UDRE1)));
 	UDR1 = data;   //send data byte
+	tx_bytes++;
 }
 
 
@@ -306,6 +601,57 @@ void Tx_USART_ram_data(char *str)
 	}
 }
 
+//transmit string in program memory (PSTR() or PROGMEM)
+void Tx_USART_pgm_data(PGM_P str)
+{
+	char c;
+	while((c = pgm_read_byte(str++)) != '\0')
+	{
+		Tx_USART(c);
+	}
+}
+
+//baud rates the modem link can run at; index 0 is the 9600 power-on default.
+//UBRR for 16MHz: 9600 normal speed, 57600 and 115200 need U2X1 to stay inside 2.1% error
+struct baud_setting
+{
+	uint16_t ubrr;
+	uint8_t u2x;
+	char ipr[14];				//command to move the modem to this rate; rate text starts at ipr[7]
+};
+
+#define BAUD_RATES	3
+const struct baud_setting baud_table[BAUD_RATES] PROGMEM =
+{
+	{103, 0, "AT+IPR=9600"},
+	{34, 1, "AT+IPR=57600"},
+	{16, 1, "AT+IPR=115200"},
+};
+
+uint8_t baud_idx = 0;			//rate USART1 is currently set to
+uint8_t ee_baud_idx EEMEM = 0;	//rate that last verified, tried first at boot
+
+//change the local rate only; the modem has to be told separately (AT+IPR)
+void set_USART_rate(uint8_t idx)
+{
+	struct baud_setting b;
+	
+	memcpy_P(&b, &baud_table[idx], sizeof b);
+	while(!(UCSR1A & (1<<UDRE1)));
+	delay_ms(2);					//let the last byte shift out at the old rate
+	if (b.u2x)
+	{
+		UCSR1A |= (1<<U2X1);
+	}
+	else
+	{
+		UCSR1A &= ~(1<<U2X1);
+	}
+	UBRR1H = (uint8_t)(b.ubrr>>8);
+	UBRR1L = (uint8_t)b.ubrr;
+	baud_idx = idx;
+}
+
 
 
 //receive data using USART
@@ -336,11 +682,59 @@ uint8_t Rx_USART()
 /*******************************Receive Interrupt********************************/
 /********************************************************************************/
 
+//lowest SMS index with its bit set in mask, 0 if none
+uint8_t sms_lowest(uint32_t mask)
+{
+	uint8_t n;
+	
+	for (n = 1; n <= 32; n++, mask >>= 1)
+	{
+		if (mask & 1)
+		{
+			return n;
+		}
+	}
+	return 0;
+}
+
+//notifications the main loop must not miss (+CMTI, +HTTPACTION) are latched here as each
+//line completes, so anything resetting ind in between can't lose them.  Every +CMTI
+//index is kept, so texts that arrive while one is being handled wait their turn.
 ISR(USART1_RX_vect)
 {
-	data_received[ind] = UDR1;
+	char c = UDR1;
+	char *line;
+	char *p;
+	
+	rx_bytes++;
+	data_received[ind] = c;
 	ind= ind + 1;
 	data_received[ind] = '\0';
+	if (c == '\n')
+	{
+		if (line_at >= ind)
+		{
+			line_at = 0;			//ind was reset since the line started
+		}
+		line = &data_received[line_at];
+		if (strncmp_P(line, PSTR("+CMTI:"), 6) == 0)
+		{
+			p = strrchr(line, ',');
+			if (p && atoi(p + 1) >= 1 && atoi(p + 1) <= 32)
+			{
+				sms_new |= 1UL << (atoi(p + 1) - 1);
+			}
+		}
+		else if (strncmp_P(line, PSTR("+HTTPACTION:"), 12) == 0)
+		{
+			p = strchr(line, ',');
+			if (p)
+			{
+				http_result = atoi(p + 1);
+			}
+		}
+		line_at = ind;
+	}
 }
 
 /********************************************************************************/
@@ -387,330 +781,2394 @@ void bin_ascii(uint8_t data, char *data_t)
 /********************************************************************************/
 /********************************************************************************/
 
-/****************************************URL AT COMMANDS*************************/
+/*****************************AT command responses*******************************/
 /********************************************************************************/
-void init_url(char *ip)
+//forget what the modem has sent so far
+void rx_clear()
 {
-	Tx_USART_ram_data(con_gprs);
-	Tx_USART(carr_rtn);
-	delay_100m();
-	Tx_USART_ram_data(apn);
-	Tx_USART(carr_rtn);
-	delay_100m();
-	Tx_USART_ram_data(en_gprs);
-	Tx_USART(carr_rtn);
-	delay_100m();
-	Tx_USART_ram_data(con_test);
-	Tx_USART(carr_rtn);
-	delay_1s();
-	Tx_USART_ram_data(en_http);
-	Tx_USART(carr_rtn);
-	delay_100m();	
-	Tx_USART_ram_data(set_profile);
-	Tx_USART(carr_rtn);
-	delay_100m();
-	Tx_USART_ram_data(url);
-	Tx_USART_ram_data(ip);
+	ind = 0;
+	data_received[0] = '\0';
+}
+
+//wait until token shows up in data_received; 0 on ERROR or timeout
+uint8_t wait_response(PGM_P token, uint16_t timeout_ms)
+{
+	uint32_t start = millis();
+	
+	while (millis() - start < timeout_ms)
+	{
+		if (strstr_P(data_received, token))
+		{
+			return 1;
+		}
+		if (strstr_P(data_received, PSTR("ERROR")))
+		{
+			return 0;
+		}
+		cpu_idle();						//the next byte wakes it
+	}
+	return 0;
+}
+
+//send a command from program memory without waiting
+void at_send(PGM_P cmd)
+{
+	rx_clear();
+	Tx_USART_pgm_data(cmd);
 	Tx_USART(carr_rtn);
-	delay_100m();
-	Tx_USART_ram_data(data_config);
+}
+
+//send a command from program memory and wait for the expected response
+uint8_t at_cmd(PGM_P cmd, PGM_P expect, uint16_t timeout_ms)
+{
+	at_send(cmd);
+	return wait_response(expect, timeout_ms);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/****************************************URL AT COMMANDS*************************/
+/********************************************************************************/
+//bearer and HTTP setup sent ahead of every post, one command per uploader step.
+//errors are expected here (bearer already open, HTTP already initialized) and ignored
+char *const url_setup[] =
+{
+	(char *)con_gprs, (char *)apn, (char *)en_gprs, (char *)con_test, (char *)en_http, (char *)set_profile, (char *)url
+};
+#define URL_SETUP_STEPS	(sizeof url_setup / sizeof url_setup[0])
+
+//the url gets ?t=<UTC seconds> when the message was queued, or ?age=<seconds since> before the
+//clock has synced, so the server doesn't have to go by arrival time
+void init_url_step(uint8_t step, uint8_t ep, uint16_t stamp)
+{
+	char when[16];
+	uint32_t epoch;
+	
+	rx_clear();
+	Tx_USART_ram_data(url_setup[step]);
+	if (url_setup[step] == url)
+	{
+		Tx_USART_ram_data((char *)server);
+		Tx_USART_pgm_data((PGM_P)pgm_read_ptr(&endpoint_path[ep]));
+		epoch = clock_epoch_at(stamp);
+		if (epoch)
+		{
+			strcpy_P(when, PSTR("?t="));
+			append_u32(when, epoch);
+		}
+		else
+		{
+			strcpy_P(when, PSTR("?age="));
+			append_u16(when, clock_age(stamp));
+		}
+		Tx_USART_ram_data(when);
+	}
 	Tx_USART(carr_rtn);
-	delay_100m();
-	//still need to input data after function call
-	//still need to send a post command after data Tx.
 }
 
 
 /********************************************************************************/
 /********************************************************************************/
 
-/******************************Function for IP data send*************************/
+/******************************pole acquisition**********************************/
+/********************************************************************************/
+//pole readings are taken by interrupts, not the main loop, so sampling keeps its own
+//cadence while the main loop waits on the modem.  Timer0 compare B (once a ms, between
+//systicks) asks for the poles whose sampler is due; each conversion's ADC interrupt
+//puts the reading in the pole's ring (sensor_core.h) and starts the next.  The uploader
+//posts what has built up in a ring as one batch.  On-demand reads (acq_read) go through
+//the same path, so nothing else touches the ADC except a burst capture.
+#define ACQ_FREE		0xFF
+
+struct sampler pole_sampler[2];
+struct sample_ring pole_ring[2];
+volatile uint8_t acq_sched = 0;			//bit per pole: its sampler is due
+volatile uint8_t acq_ask = 0;			//bit per pole: acq_read() is waiting
+volatile uint8_t acq_pole = ACQ_FREE;	//pole being converted
+volatile uint8_t acq_code[2];			//last conversion per pole
+volatile uint8_t capture_on = 0;		//a burst capture has the ADC
+uint16_t acq_ms = 0;
+
+//start the next wanted conversion if the ADC is free; interrupts off
+void acq_start()
+{
+	uint8_t want = acq_sched | acq_ask;
+	
+	if (acq_pole != ACQ_FREE || capture_on || !want)
+	{
+		return;
+	}
+	acq_pole = (want & 1) ? 0 : 1;
+	ADMUX = (acq_pole ? POLE2 : POLE1)|AREF|(1<<ADLAR);
+	ADCSRA |= (1<<ADIF)|(1<<ADIE)|(1<<ADSC);		//writing ADIF clears a flag left by a polled conversion
+}
+
+//from the ADC interrupt: a pole conversion finished
+void acq_done()
+{
+	uint8_t n = acq_pole;
+	uint8_t bit = 1<<n;
+	uint16_t ohms;
+	
+	acq_code[n] = ADCH;
+	ADCSRA &= ~(1<<ADIE);
+	acq_pole = ACQ_FREE;
+	if (acq_sched & bit)
+	{
+		ohms = adc_to_ohms(n ? CAL_CH2 : CAL_CH1, acq_code[n]);
+		sampler_feed(&pole_sampler[n], ohms, uptime_s);
+		ring_push(&pole_ring[n], ohms, (uint16_t)uptime_s);
+		if (pole_ring[n].n > RING_HIGH)
+		{
+			pole_sampler[n].due += pole_sampler[n].interval_s;		//the link is behind: back off
+			pole_ring[n].throttled++;
+		}
+	}
+	acq_sched &= ~bit;
+	acq_ask &= ~bit;
+	acq_start();
+}
+
+ISR(TIMER0_COMPB_vect)
+{
+	uint8_t n;
+	
+	if (++acq_ms < 1000)
+	{
+		return;
+	}
+	acq_ms = 0;
+	for (n = 0; n < 2; n++)
+	{
+		if (pole_sampler[n].min_s && sampler_due(&pole_sampler[n], uptime_s))
+		{
+			acq_sched |= 1<<n;
+		}
+	}
+	acq_start();
+}
+
+void init_acquisition()
+{
+	OCR0B = 124;						//halfway between systicks
+	TIMSK0 |= (1<<OCIE0B);
+}
+
+//on-demand reading of pole n (0 or 1), raw ADC code
+uint8_t acq_read(uint8_t n)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		acq_ask |= 1<<n;
+		acq_start();
+	}
+	while (acq_ask & (1<<n));
+	return acq_code[n];
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************waveform capture**********************************/
 /********************************************************************************/
+//burst capture of one pole: Timer1 compare match B auto-triggers the ADC at CAPTURE_HZ
+//and the ADC interrupt fills capture_buf.  The upload is delta + zigzag + varint
+//encoded on the fly (wave_encode() in sensor_core.h), so the buffer is the only RAM it needs.
+#define CAPTURE_LEN		256				//128ms at 2kHz; see tools/sram_budget.txt
+#define CAPTURE_HZ		2000
+#define CAPTURE_TIMER	2000000UL		//Timer1 at clk/8
+
+uint8_t capture_buf[CAPTURE_LEN];
+volatile uint16_t capture_n = 0;		//samples taken so far
+uint8_t capture_pole = 0;				//1 or 2 once a capture has been taken
+
+void capture_start(uint8_t input_ch, uint8_t pole_no)
+{
+	capture_on = 1;
+	while (acq_pole != ACQ_FREE);				//let a pole reading in progress finish
+	init_ADC(input_ch);
+	capture_pole = pole_no;
+	capture_n = 0;
+	ADCSRB = (1<<ADTS2)|(1<<ADTS0);				//auto trigger source: Timer1 compare match B
+	ADCSRA |= (1<<ADATE)|(1<<ADIE);
+	TCCR1A = 0;
+	TCNT1 = 0;
+	OCR1A = CAPTURE_TIMER/CAPTURE_HZ - 1;		//CTC top sets the rate
+	OCR1B = OCR1A;
+	TIFR1 = (1<<OCF1B);
+	TCCR1B = (1<<WGM12)|(1<<CS11);				//CTC, clk/8: starts sampling
+}
+
+//give the ADC back to pole acquisition, at the end of a burst or on a timeout; interrupts off
+void capture_stop()
+{
+	TCCR1B = 0;
+	ADCSRA &= ~((1<<ADATE)|(1<<ADIE));		//back to single conversions
+	capture_on = 0;
+	acq_start();							//pole readings that came due meanwhile
+}
+
+//the ADC interrupt is shared with pole acquisition
+ISR(ADC_vect)
+{
+	adc_conversions++;
+	if (acq_pole != ACQ_FREE)
+	{
+		acq_done();
+		return;
+	}
+	capture_buf[capture_n++] = ADCH;
+	TIFR1 = (1<<OCF1B);							//the trigger is the flag's rising edge, clear it for the next one
+	if (capture_n >= CAPTURE_LEN)
+	{
+		capture_stop();
+	}
+}
+
+uint8_t capture_done()
+{
+	uint16_t n;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		n = capture_n;
+	}
+	return n >= CAPTURE_LEN;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************modem power***************************************/
+/********************************************************************************/
+//between activity windows the modem runs AT+CSCLK=1 slow clock: DTR high lets it
+//sleep, DTR low wakes it (its UART is dead until then).  An incoming SMS still wakes
+//it and pulses RI low, which INT0 watches.  Time in each state is kept for the
+//modem report, and the energy accounting follows it.
+#define MODEM_DTR		(1<<PINB5)		//modem DTR, output (low = awake); already an output in init_dio()
+#define MODEM_RI		(1<<PIND0)		//modem RI, input on INT0
+#define MODEM_IDLE_MS	5000			//awake this long with nothing to do, then sleep
+#define MODEM_WAKE_MS	60				//DTR low to UART usable is 50ms
+
+enum modem_pwr
+{
+	MODEM_AWAKE, MODEM_ASLEEP, MODEM_PWR_STATES
+};
+
+uint8_t modem_pwr = MODEM_AWAKE;
+uint8_t modem_sleep_ok = 0;			//AT+CSCLK=1 was accepted
+uint32_t modem_pwr_since = 0;
+uint32_t modem_last_active = 0;
+uint32_t modem_pwr_s[MODEM_PWR_STATES];	//whole seconds in each state
+uint16_t modem_pwr_ms[MODEM_PWR_STATES];	//and what's under a second
+uint16_t modem_wakes = 0;
+volatile uint8_t ri_wake = 0;
+
+ISR(INT0_vect)
+{
+	if (modem_pwr == MODEM_ASLEEP)
+	{
+		ri_wake = 1;
+	}
+}
+
+//add the time since modem_pwr_since to the state the modem is in
+void modem_pwr_sync()
+{
+	uint32_t now = millis();
+	uint32_t t = now - modem_pwr_since + modem_pwr_ms[modem_pwr];
+	
+	modem_pwr_s[modem_pwr] += t / 1000;
+	modem_pwr_ms[modem_pwr] = t % 1000;
+	modem_pwr_since = now;
+}
+
+void modem_pwr_enter(uint8_t state)
+{
+	modem_pwr_sync();
+	modem_pwr = state;
+	energy_modem(state == MODEM_ASLEEP ? PWR_MODEM_SLEEP : PWR_MODEM);
+}
+
+//modem must be on, awake and in text mode
+void init_modem_power()
+{
+	DDRD &= ~MODEM_RI;
+	PORTD |= MODEM_RI;					//pull-up
+	EICRA = (1<<ISC01);					//INT0 on falling edge
+	EIMSK = (1<<INT0);
+	modem_sleep_ok = at_cmd(PSTR("AT+CSCLK=1"), PSTR("OK"), 1000);
+	modem_pwr_since = millis();
+	modem_last_active = modem_pwr_since;
+}
+
+//call before talking to the modem
+void modem_wake()
+{
+	modem_last_active = millis();
+	if (modem_pwr == MODEM_ASLEEP)
+	{
+		PORTB &= ~MODEM_DTR;
+		delay_ms(MODEM_WAKE_MS);
+		modem_pwr_enter(MODEM_AWAKE);
+		modem_wakes++;
+	}
+}
+
+//idle: nothing queued or in flight.  Puts the modem to sleep after MODEM_IDLE_MS of
+//idle, and wakes it when RI says an SMS came in while it slept
+void modem_power_poll(uint8_t idle)
+{
+	uint32_t start;
+	uint8_t n;
+	
+	if (millis() - modem_pwr_since >= 60000)
+	{
+		modem_pwr_sync();				//long before millis() differences wrap
+	}
+	if (ri_wake)
+	{
+		ri_wake = 0;
+		modem_wake();
+		start = millis();
+		while (!sms_new && millis() - start < 300);
+		n = sms_lowest(~sms_done);
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (!sms_new && n)
+			{
+				//+CMTI was lost while the UART woke up; the modem stores a new text at its
+				//lowest free index, so check the first one not waiting to be deleted
+				sms_new = 1UL << (n - 1);
+			}
+		}
+	}
+	if (!idle)
+	{
+		modem_last_active = millis();
+		return;
+	}
+	if (modem_sleep_ok && modem_pwr == MODEM_AWAKE && millis() - modem_last_active >= MODEM_IDLE_MS)
+	{
+		PORTB |= MODEM_DTR;
+		modem_pwr_enter(MODEM_ASLEEP);
+	}
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************outbound queue************************************/
+/********************************************************************************/
+//everything the device posts goes through here and is sent by uploader_poll().
+//most urgent class first, oldest first within a class (see sensor_core.h)
+struct outq outq;
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************HTTP uploader*************************************/
+/********************************************************************************/
+//posts the queue one message at a time without blocking: each uploader_poll() call
+//checks for the reply the current step is waiting on and moves on when it's there.
+//a post is the url setup, HTTPDATA + payload, then HTTPACTION and its +HTTPACTION result.
+//a failed step is retried on its own with exponential backoff and jitter; the payload
+//stays in the modem so a failed action doesn't resend it.  When the bearer won't come up
+//SMS_FALLBACK_FAILS times running the queue goes out by SMS instead (see SMS uplink).
+#define UP_STEP_MS		2000	//reply timeout for setup and data commands
+#define SMS_FALLBACK_FAILS	3
+#define SMS_PROBE_S		600		//how often the bearer is tried again in SMS mode
+
+struct http_count
+{
+	uint16_t ok;
+	uint16_t retry;
+	uint16_t drop;
+};
+struct http_count http_stats[EP_COUNT];
+
+enum up_state
+{
+	UP_IDLE,		//nothing in flight
+	UP_SETUP,		//url_setup[step] sent
+	UP_DATA,		//HTTPDATA sent, waiting for DOWNLOAD
+	UP_BODY,		//payload sent, waiting for OK
+	UP_ACTION,		//HTTPACTION sent, waiting for OK
+	UP_RESULT,		//waiting for +HTTPACTION (modem is free for other commands)
+	UP_BACKOFF		//waiting to retry (modem is free for other commands)
+};
+
+struct uploader
+{
+	uint8_t state;
+	uint8_t step;			//url_setup command, UP_SETUP only
+	uint8_t tries;			//failures of the current step
+	uint8_t resume;			//UP_SETUP, UP_DATA or UP_ACTION once the backoff is over
+	uint32_t since;			//when the current command went out
+	uint16_t wait_ms;		//how long its reply (or the backoff) may take
+	uint32_t started;		//when the post was taken off the queue
+	struct out_msg msg;
+};
+struct uploader up;
+struct link link;			//link quality, sampled by link_sample(); posts are timed against it
+uint8_t sms_mode = 0;		//GPRS is down: the uploader stands aside and sms_uplink_poll() sends the queue
+uint8_t bearer_fails = 0;	//bearer setups failed in a row
+uint16_t sms_switches = 0;	//times GPRS was given up for SMS
+uint32_t sms_probe_at = 0;	//uptime of the next bearer probe while in SMS mode
+
+//the pole ring a batch post drains, 0 for any other post.  A batch is queued as
+//"B" and its body comes from the ring, like a capture's comes from capture_buf
+struct sample_ring *up_ring(struct out_msg *m)
+{
+	if (m->len != 1 || m->body[0] != 'B')
+	{
+		return 0;
+	}
+	return m->ep == EP_DATA2 ? &pole_ring[1] : &pole_ring[0];
+}
+
+void up_expect(uint8_t state, uint16_t wait_ms)
+{
+	energy_modem(state == UP_ACTION || state == UP_RESULT ? PWR_GPRS : PWR_MODEM);
+	up.state = state;
+	up.since = millis();
+	up.wait_ms = wait_ms;
+}
+
+//0 still waiting, 1 token arrived, 2 ERROR or timed out
+uint8_t up_reply(PGM_P token)
+{
+	if (strstr_P(data_received, token))
+	{
+		return 1;
+	}
+	if (strstr_P(data_received, PSTR("ERROR")) || millis() - up.since >= up.wait_ms)
+	{
+		return 2;
+	}
+	return 0;
+}
+
+//length of the payload in flight, sent to the modem as well when send is set.
+//captures are encoded straight out of capture_buf rather than held in the message
+uint16_t up_payload(uint8_t send)
+{
+	struct sample_ring *ring = up_ring(&up.msg);
+	uint8_t i;
+	
+	if (up.msg.ep == EP_WAVE1 || up.msg.ep == EP_WAVE2)
+	{
+		return wave_encode(capture_buf, CAPTURE_LEN, capture_pole, CAPTURE_HZ, send ? Tx_USART : 0);
+	}
+	if (ring)
+	{
+		return batch_encode(ring, ring->pinned, send ? Tx_USART : 0);
+	}
+	for (i = 0; send && i < up.msg.len; i++)
+	{
+		Tx_USART(up.msg.body[i]);
+	}
+	return up.msg.len;
+}
+
+void up_send_data()
+{
+	char cmd[20];
+	
+	strcpy_P(cmd, PSTR("AT+HTTPDATA="));
+	append_u16(cmd, up_payload(0));
+	strcat_P(cmd, PSTR(",1500"));
+	rx_clear();
+	Tx_USART_ram_data(cmd);
+	Tx_USART(carr_rtn);
+	up_expect(UP_DATA, UP_STEP_MS);
+}
+
+void up_send_action()
+{
+	http_result = 0;
+	at_send(PSTR("AT+HTTPACTION=1"));
+	up_expect(UP_ACTION, UP_STEP_MS);
+}
+
+//the post in flight is finished with, sent or not
+void up_done()
+{
+	struct sample_ring *ring = up_ring(&up.msg);
+	
+	if (ring)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			ring_release(ring);
+		}
+	}
+	link_post_time(&link, millis() - up.started);
+	up.state = UP_IDLE;
+	energy_modem(PWR_MODEM);
+	op_end(OP_POST);
+}
+
+//put the post in flight back on the queue, keeping its original time
+void up_requeue()
+{
+	struct sample_ring *ring = up_ring(&up.msg);
+	
+	if (ring)
+	{
+		ring->pinned = 0;					//back in the ring for the next batch
+	}
+	if (up.msg.prio == PRIO_TELEMETRY || !outq_find(&outq, up.msg.prio, up.msg.ep))
+	{
+		outq_push(&outq, up.msg.prio, up.msg.ep, up.msg.body, up.msg.len, up.msg.stamp);
+	}
+	up.state = UP_IDLE;						//else a newer state for the endpoint is already queued
+	energy_modem(PWR_MODEM);
+	op_end(OP_POST);
+}
+
+//a step failed: back off and retry that step, or drop the post
+void up_fail(uint8_t step_state)
+{
+	if (++up.tries >= HTTP_TRIES)
+	{
+		http_stats[up.msg.ep].drop++;
+		up_done();
+		return;
+	}
+	http_stats[up.msg.ep].retry++;
+	up.resume = step_state;
+	up_expect(UP_BACKOFF, http_backoff_ms(up.tries));
+}
+
+//the bearer didn't come up: retry the setup, or after SMS_FALLBACK_FAILS in a row
+//hand the post back to the queue and switch to SMS
+void up_bearer_fail()
+{
+	if (++bearer_fails < SMS_FALLBACK_FAILS)
+	{
+		up_fail(UP_SETUP);
+		return;
+	}
+	up_requeue();
+	sms_mode = 1;
+	sms_switches++;
+	sms_probe_at = uptime() + SMS_PROBE_S;
+}
+
+void uploader_poll()
+{
+	struct sample_ring *ring;
+	struct out_msg *head;
+	uint16_t status;
+	uint8_t r;
+	
+	switch (up.state)
+	{
+		case UP_IDLE:
+			if (sms_mode || !outq_pop(&outq, &up.msg))
+			{
+				break;
+			}
+			up.started = millis();
+			op_begin(OP_POST);
+			if ((ring = up_ring(&up.msg)))
+			{
+				ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+				{
+					ring->pinned = ring->n;			//readings taken from here on go in the next batch
+				}
+				up.msg.stamp = ring_at(ring, 0)->stamp;
+			}
+			modem_wake();
+			up.step = 0;
+			up.tries = 0;
+			init_url_step(0, up.msg.ep, up.msg.stamp);
+			up_expect(UP_SETUP, UP_STEP_MS);
+		break;
+		case UP_SETUP:
+			if (!up_reply(PSTR("OK")))
+			{
+				break;
+			}
+			if (url_setup[up.step] == con_test)
+			{
+				if (!strstr_P(data_received, PSTR("+SAPBR: 1,1")))		//bearer not connected
+				{
+					up_bearer_fail();
+					break;
+				}
+				bearer_fails = 0;
+			}
+			if (++up.step < URL_SETUP_STEPS)
+			{
+				init_url_step(up.step, up.msg.ep, up.msg.stamp);
+				up_expect(UP_SETUP, UP_STEP_MS);
+			}
+			else
+			{
+				up_send_data();
+			}
+		break;
+		case UP_DATA:
+			r = up_reply(PSTR("DOWNLOAD"));
+			if (r == 1)
+			{
+				rx_clear();
+				up_payload(1);
+				up_expect(UP_BODY, UP_STEP_MS);
+			}
+			else if (r == 2)
+			{
+				up_fail(UP_DATA);
+			}
+		break;
+		case UP_BODY:
+			r = up_reply(PSTR("OK"));
+			if (r == 1)
+			{
+				up.tries = 0;
+				up_send_action();
+			}
+			else if (r == 2)
+			{
+				up_fail(UP_DATA);
+			}
+		break;
+		case UP_ACTION:
+			r = up_reply(PSTR("OK"));
+			if (r == 1)
+			{
+				up_expect(UP_RESULT, HTTP_ACTION_MS);
+			}
+			else if (r == 2)
+			{
+				up_fail(UP_ACTION);
+			}
+		break;
+		case UP_RESULT:
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				status = http_result;
+			}
+			if (status && http_verdict(status) == HTTP_DONE)
+			{
+				http_stats[up.msg.ep].ok++;
+				up_done();
+			}
+			else if (status && http_verdict(status) == HTTP_GIVE_UP)
+			{
+				http_stats[up.msg.ep].drop++;
+				up_done();
+			}
+			else if (status || millis() - up.since >= up.wait_ms)
+			{
+				up_fail(UP_ACTION);
+			}
+		break;
+		case UP_BACKOFF:
+			head = outq_head(&outq);
+			if (head && head->prio < up.msg.prio)		//something more urgent came in; it goes first
+			{
+				up_requeue();
+			}
+			else if (millis() - up.since >= up.wait_ms)
+			{
+				if (up.resume == UP_SETUP)				//the bearer setup starts over
+				{
+					up.step = 0;
+					init_url_step(0, up.msg.ep, up.msg.stamp);
+					up_expect(UP_SETUP, UP_STEP_MS);
+				}
+				else if (up.resume == UP_DATA)
+				{
+					up_send_data();
+				}
+				else
+				{
+					up_send_action();
+				}
+			}
+		break;
+	}
+}
+
+//1 while a command is out and its reply is still coming
+uint8_t uploader_busy()
+{
+	return up.state != UP_IDLE && up.state != UP_RESULT && up.state != UP_BACKOFF;
+}
+
+//run the uploader to a point where the modem can take another command.
+//call before any blocking AT exchange outside the uploader
+void modem_acquire()
+{
+	modem_wake();
+	while (uploader_busy())
+	{
+		uploader_poll();
+	}
+}
+
+//post everything queued before going on (in SMS mode it waits for sms_uplink_poll())
+void uploader_flush()
+{
+	while ((outq.len && !sms_mode) || up.state != UP_IDLE)
+	{
+		uploader_poll();
+	}
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************capture upload************************************/
+/********************************************************************************/
+//capture_buf is in use while its upload is queued or in flight
+uint8_t capture_busy()
+{
+	return outq_find(&outq, PRIO_TELEMETRY, EP_WAVE1) || outq_find(&outq, PRIO_TELEMETRY, EP_WAVE2) ||
+		(up.state != UP_IDLE && (up.msg.ep == EP_WAVE1 || up.msg.ep == EP_WAVE2));
+}
+
+//capture a pole (POLE1/POLE2) and queue the upload; 0 if the last capture is still going
+//out, or if the burst didn't finish within a second (nothing is queued then)
+uint8_t capture_run(uint8_t input_ch, uint8_t pole_no)
+{
+	uint32_t start;
+	uint8_t timed_out;
+	
+	if (capture_busy())
+	{
+		return 0;
+	}
+	op_begin(OP_CAPTURE);
+	capture_start(input_ch, pole_no);
+	start = millis();
+	while (!capture_done() && millis() - start < 1000);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		timed_out = capture_on;					//the ADC interrupt clears it when the burst is complete
+		if (timed_out)
+		{
+			capture_stop();
+		}
+	}
+	if (timed_out)
+	{
+		capture_pole = 0;						//capture_buf holds part of a burst
+		op_end(OP_CAPTURE);
+		return 0;
+	}
+	outq_push(&outq, PRIO_TELEMETRY, pole_no == 1 ? EP_WAVE1 : EP_WAVE2, "W", 1, clock_stamp());	//body comes from capture_buf
+	op_end(OP_CAPTURE);
+	return 1;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************clock sync****************************************/
+/********************************************************************************/
+//AT+CLTS=1 has the modem set its RTC from network time on registration (kept by the
+//AT&W in negotiate_baud()).  Re-anchored every CLOCK_SYNC_S, retried sooner until it works.
+#define CLOCK_SYNC_S	21600UL			//6 hours
+#define CLOCK_RETRY_S	600UL
+
+uint32_t clock_next_sync = 0;			//uptime of the next sync attempt
+
+uint8_t clock_sync()
+{
+	char *p;
+	uint32_t epoch;
+	
+	modem_acquire();
+	if (!at_cmd(PSTR("AT+CCLK?"), PSTR("OK"), 1000))
+	{
+		return 0;
+	}
+	p = strstr_P(data_received, PSTR("+CCLK: \""));
+	if (!p || !(epoch = clock_parse(p + 8)))
+	{
+		return 0;
+	}
+	clock_anchor_up = uptime();
+	clock_anchor_epoch = epoch;
+	return 1;
+}
+
+//sync when due, only while the uploader isn't using the modem
+void clock_poll()
+{
+	if (uptime() < clock_next_sync || up.state != UP_IDLE)
+	{
+		return;
+	}
+	op_begin(OP_CLOCK);
+	clock_next_sync = uptime() + (clock_sync() ? CLOCK_SYNC_S : CLOCK_RETRY_S);
+	op_end(OP_CLOCK);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************link quality**************************************/
+/********************************************************************************/
+//sampled only when there are readings to send, the last sample is over LINK_POLL_S old
+//and the modem is awake anyway (it stays up MODEM_IDLE_MS after any use), so checking
+//never wakes it; while it sleeps the last estimate stands.  Acks, faults and captures
+//always go; pole batches wait for a good link (link_allows()), or LINK_DEFER_MAX_S.
+uint8_t link_held[2];			//a pole's readings are waiting for a good link
+
+//AT+CSQ and AT+CREG? into the estimator; 0 if the modem didn't answer
+uint8_t link_sample()
+{
+	char *p;
+	uint8_t csq;
+	
+	link.at = uptime();			//not again for LINK_POLL_S, even if this fails
+	modem_acquire();
+	if (!at_cmd(PSTR("AT+CSQ"), PSTR("OK"), 1000) || !(p = strstr_P(data_received, PSTR("+CSQ: "))))
+	{
+		return 0;
+	}
+	csq = atoi(p + 6);
+	if (!at_cmd(PSTR("AT+CREG?"), PSTR("OK"), 1000) || !(p = strstr_P(data_received, PSTR("+CREG: "))) || !(p = strchr(p, ',')))
+	{
+		return 0;
+	}
+	link_feed(&link, csq, atoi(p + 1), uptime());
+	return 1;
+}
+
+//1 if pole n's waiting readings may go up now: the link is good, or the oldest has waited too long
+uint8_t link_allows(uint8_t n)
+{
+	uint16_t oldest;
+	
+	if (link_stale(&link, uptime()) && up.state == UP_IDLE && modem_pwr == MODEM_AWAKE)
+	{
+		op_begin(OP_LINK);
+		link_sample();
+		op_end(OP_LINK);
+	}
+	if (link.good)
+	{
+		return 1;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		oldest = ring_at(&pole_ring[n], pole_ring[n].pinned)->stamp;
+	}
+	return clock_age(oldest) >= LINK_DEFER_MAX_S;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************Function for IP data send*************************/
+/********************************************************************************/
+
+//queues the upload; uploader_poll() sends it
+void send_data_url(char *control_2, char *data_2)
+{
+	if((strcmp(control_2, pole_1)==0))
+		{
+			data_ch1 = acq_read(0);
+			ohms_ascii(adc_to_ohms(CAL_CH1, data_ch1), data1);
+			outq_push(&outq, PRIO_TELEMETRY, EP_DATA1, data1, 8, clock_stamp());
+		}
+	
+	if((strcmp(control_2, pole_2)==0))
+	{
+		data_ch2 = acq_read(1);
+		ohms_ascii(adc_to_ohms(CAL_CH2, data_ch2), data2);
+		outq_push(&outq, PRIO_TELEMETRY, EP_DATA2, data2, 8, clock_stamp());
+	}
+
+	if((strcmp(control_2, poles)==0))
+	{
+		data_ch1 = acq_read(0);
+		ohms_ascii(adc_to_ohms(CAL_CH1, data_ch1), data1);
+		data_ch2 = acq_read(1);
+		ohms_ascii(adc_to_ohms(CAL_CH2, data_ch2), data2);
+		outq_push(&outq, PRIO_TELEMETRY, EP_DATA1, data1, 8, clock_stamp());
+		outq_push(&outq, PRIO_TELEMETRY, EP_DATA2, data2, 8, clock_stamp());
+	}
+	
+	if((strcmp(control_2, bad_res)==0)&&(strcmp(data_2, pole_1)==0))
+	{
+		outq_push(&outq, PRIO_FAULT, EP_BAD1, "0", 1, clock_stamp());
+	}
+	if((strcmp(control_2, bad_res)==0)&&(strcmp(data_2, pole_2)==0))
+	{
+		outq_push(&outq, PRIO_FAULT, EP_BAD2, "0", 1, clock_stamp());
+	}
+	
+	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, pole_1)==0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_STAT1, "true", 4, clock_stamp());
+	}	
+	
+	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, pole_2)==0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_STAT2, "true", 4, clock_stamp());
+	}
+	
+	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2,"1OFF")== 0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_STAT1, "false", 5, clock_stamp());
+	}
+	
+	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, "2OFF")== 0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_STAT2, "false", 5, clock_stamp());
+	}
+	
+	
+	if((strcmp(control_2, init_status1)==0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_INIT1, data_2, strlen(data_2), clock_stamp());
+	}
+	
+	if((strcmp(control_2, init_status2)==0))
+	{
+		outq_push(&outq, PRIO_ACK, EP_INIT2, data_2, strlen(data_2), clock_stamp());
+	}
+}
+
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************** turn on GSM ***********************************/
+/********************************************************************************/
+
+void on_gsm(){
+	//turn on gsm module
+	PORTB &= ~GSM_ON;
+	delay_2s();			//requires a 2sec low on key pin to turn on
+	delay_500m();
+	PORTB |= GSM_ON;
+	delay_2s();			//wait long time for power on notifications and sms notifications
+	delay_2s();
+	delay_2s();
+	delay_2s();
+	delay_2s();
+	delay_2s();	
+	ind = 0;			//reset after notifications
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/**************************** turn off echo GSM *********************************/
+/********************************************************************************/
+void echo_off()
+{
+	Tx_USART_ram_data(no_echo);			//turn off echo
+	//delay_10m();
+	Tx_USART(carr_rtn);
+	delay_2s();
+	//strcpy(data_received, "\0");
+	ind = 0;
+}
+
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/***************************send data through sms *******************************/
+/********************************************************************************/
+//be sure to set text mode before use
+void send_data_sms(char *message)
+{
+	op_begin(OP_SMS_OUT);
+	modem_acquire();
+	Tx_USART_ram_data(num_cmd);
+	Tx_USART_ram_data(num);
+	Tx_USART(carr_rtn);
+	delay_10m();
+	Tx_USART_ram_data(message);
+	delay_10m();
+	Tx_USART(ctrl_z);
+	delay_1s();
+	ind = 0;
+	op_end(OP_SMS_OUT);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************SMS uplink****************************************/
+/********************************************************************************/
+//while sms_mode is set the queue goes out as packed SMS (sensor_core.h) instead of
+//posts: faults and acks at once, pole readings at most every SMS_GAP_S so a busy pole
+//doesn't send a text per reading.  Captures don't fit in a text and are dropped.
+//Every SMS_PROBE_S the bearer is tried again, and once it's up the uploader takes over.
+#define SMS_GAP_S		300
+
+struct sms_count
+{
+	uint16_t sent;
+	uint16_t records;
+	uint16_t dropped;		//captures given up on
+};
+struct sms_count sms_stats;
+uint16_t sms_seq = 0;
+uint32_t sms_last = 0;		//uptime of the last packed SMS
+
+//1 if the queue has something that should go out by SMS now
+uint8_t sms_due()
+{
+	struct out_msg *head = outq_head(&outq);
+	
+	return head && (head->prio != PRIO_TELEMETRY || uptime() - sms_last >= SMS_GAP_S);
+}
+
+//1 while the uploader has nothing to do, so the modem can sleep
+uint8_t uplink_idle()
+{
+	if (sms_mode)
+	{
+		return !sms_due();
+	}
+	return !outq.len && up.state == UP_IDLE;
+}
+
+//the value a queued message packs as: ohms for a reading, 1/0 for a true/false ack
+uint16_t sms_value(struct out_msg *m)
+{
+	char buf[sizeof m->body + 1];
+	
+	if (m->ep == EP_DATA1 || m->ep == EP_DATA2)
+	{
+		memcpy(buf, m->body, m->len);
+		buf[m->len] = '\0';
+		return strtoul(buf, 0, 10);
+	}
+	return m->len && m->body[0] == 't';
+}
+
+//pack as much of the queue as fits into one SMS and send it
+void sms_uplink()
+{
+	struct sms_pack pack;
+	struct out_msg msg;
+	struct out_msg *m;
+	struct sample_ring *ring;
+	uint16_t stamp;
+	uint32_t epoch;
+	uint8_t n;
+	uint8_t k;
+	
+	while ((m = outq_head(&outq)) && (m->ep == EP_WAVE1 || m->ep == EP_WAVE2))
+	{
+		outq_pop(&outq, &msg);
+		sms_stats.dropped++;
+	}
+	if (!m)
+	{
+		return;
+	}
+	stamp = m->stamp;
+	if ((ring = up_ring(m)) && ring->n)
+	{
+		stamp = ring_at(ring, 0)->stamp;
+	}
+	epoch = clock_epoch_at(stamp);
+	sms_pack_start(&pack, sms_seq, epoch != 0, epoch ? epoch : clock_age(stamp), stamp);
+	while ((m = outq_head(&outq)))
+	{
+		if (m->ep == EP_WAVE1 || m->ep == EP_WAVE2)
+		{
+			outq_pop(&outq, &msg);
+			sms_stats.dropped++;
+			continue;
+		}
+		if ((ring = up_ring(m)))
+		{
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				n = ring->n;
+			}
+			for (k = 0; k < n && sms_pack_add(&pack, m->ep, ring_at(ring, k)->stamp, ring_at(ring, k)->ohms); k++);
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+			{
+				ring->pinned = k;
+				ring_release(ring);
+			}
+			sms_stats.records += k;
+			if (k < n)
+			{
+				break;					//text is full; the batch stays queued for the rest
+			}
+		}
+		else if (sms_pack_add(&pack, m->ep, m->stamp, sms_value(m)))
+		{
+			sms_stats.records++;
+		}
+		else
+		{
+			break;
+		}
+		outq_pop(&outq, &msg);
+	}
+	if (pack.records)
+	{
+		send_data_sms(pack.text);
+		sms_seq = (sms_seq + 1) & SMS_SEQ_MASK;
+		sms_stats.sent++;
+	}
+	sms_last = uptime();
+}
+
+//1 if the bearer comes up
+uint8_t bearer_probe()
+{
+	uint8_t step;
+	
+	modem_acquire();
+	for (step = 0; url_setup[step] != con_test; step++)
+	{
+		init_url_step(step, 0, 0);
+		wait_response(PSTR("OK"), UP_STEP_MS);
+	}
+	init_url_step(step, 0, 0);
+	return wait_response(PSTR("+SAPBR: 1,1"), UP_STEP_MS);
+}
+
+void sms_uplink_poll()
+{
+	if (!sms_mode)
+	{
+		return;
+	}
+	if (uptime() >= sms_probe_at)
+	{
+		sms_probe_at = uptime() + SMS_PROBE_S;
+		if (bearer_probe())
+		{
+			sms_mode = 0;
+			bearer_fails = 0;
+			return;
+		}
+	}
+	if (sms_due())
+	{
+		sms_uplink();
+	}
+}
+
+//"SMS mode:<0/1> switches:<n> sent:<n> records:<n> dropped:<captures> seq:<n>" texted back on DIAG_REQ
+void send_sms_diag()
+{
+	char msg[96];
+	
+	strcpy_P(msg, PSTR("SMS mode:"));
+	append_u16(msg, sms_mode);
+	strcat_P(msg, PSTR(" switches:"));
+	append_u16(msg, sms_switches);
+	strcat_P(msg, PSTR(" sent:"));
+	append_u16(msg, sms_stats.sent);
+	strcat_P(msg, PSTR(" records:"));
+	append_u16(msg, sms_stats.records);
+	strcat_P(msg, PSTR(" dropped:"));
+	append_u16(msg, sms_stats.dropped);
+	strcat_P(msg, PSTR(" seq:"));
+	append_u16(msg, sms_seq);
+	send_data_sms(msg);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/********************************* set Text mode ********************************/
+/********************************************************************************/
+void set_Textmode()
+{
+	ind = 0;
+	Tx_USART_ram_data(text_mode);
+	Tx_USART(carr_rtn);
+	delay_100m();
+	ind = 0;
+	Tx_USART_ram_data(full_text);
+	Tx_USART(carr_rtn);
+	delay_100m();
+}
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************power check GSM***********************************/
+/********************************************************************************/
+//returns 1 if power on; returns 0 if not powered on
+uint8_t pwr_chkGSM()
+{
+	ind = 0;
+	Tx_USART_ram_data(at);
+	Tx_USART(carr_rtn);
+	delay_1s();			//wait for receive to complete
+	if(data_received[2]=='O')	
+	{
+		ind = 0;
+		return 1;
+	}
+	return 0; //TEE HEE >:( -- Bear was here!
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************Delete all SMS************************************/
+/********************************************************************************/
+//be in text mode before calling this.  All of them: only at boot, when nothing is waiting
+void delete_sms()
+{	
+	modem_acquire();
+	rx_clear();
+	Tx_USART_ram_data(delete_all);
+	Tx_USART(carr_rtn);
+	wait_response(PSTR("OK"), 4000);		//max response time
+	ind = 0;
+}
+
+//the text at index only, so any that came in after it stay to be read
+void delete_sms_at(uint8_t index)
+{
+	char num[4] = "";
+	
+	append_u16(num, index);
+	modem_acquire();
+	rx_clear();
+	Tx_USART_pgm_data(PSTR("AT+CMGD="));
+	Tx_USART_ram_data(num);
+	Tx_USART(carr_rtn);
+	wait_response(PSTR("OK"), 5000);		//max response time
+	ind = 0;
+}
+/********************************************************************************/
+/********************************************************************************/
+
+/*****************************baud rate negotiation******************************/
+/********************************************************************************/
+//the link is good if three ATs in a row get an OK
+uint8_t verify_link()
+{
+	uint8_t i;
+	for (i = 0; i < 3; i++)
+	{
+		if (!at_cmd(PSTR("AT"), PSTR("OK"), 300))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//find the rate the modem is answering at (it keeps AT+IPR across power cycles after AT&W).
+//tries the last verified rate first; leaves USART1 at 9600 if nothing answers
+uint8_t link_find()
+{
+	uint8_t idx = eeprom_read_byte(&ee_baud_idx);
+	uint8_t n;
+	
+	if (idx >= BAUD_RATES)
+	{
+		idx = 0;
+	}
+	for (n = 0; n < BAUD_RATES; n++)
+	{
+		set_USART_rate(idx);
+		if (verify_link())
+		{
+			return 1;
+		}
+		idx = (idx + 1) % BAUD_RATES;
+	}
+	set_USART_rate(0);
+	return 0;
+}
+
+//move both ends to baud_table[idx] and verify.  On failure find wherever the
+//modem ended up and return 0
+uint8_t switch_baud(uint8_t idx)
+{
+	if (idx == baud_idx)
+	{
+		return verify_link();
+	}
+	if (!at_cmd(baud_table[idx].ipr, PSTR("OK"), 500))		//answered at the old rate
+	{
+		return 0;
+	}
+	set_USART_rate(idx);
+	delay_ms(50);
+	if (verify_link())
+	{
+		return 1;
+	}
+	link_find();
+	return 0;
+}
+
+//run the link as fast as it verifies, falling back to 9600.  The chosen rate is saved
+//in the modem profile (AT&W) and in EEPROM so the next boot finds it first
+uint8_t negotiate_baud()
+{
+	uint8_t idx;
+	
+	for (idx = BAUD_RATES - 1; idx > 0; idx--)
+	{
+		if (switch_baud(idx))
+		{
+			break;
+		}
+	}
+	if (idx == 0 && baud_idx != 0)
+	{
+		switch_baud(0);
+	}
+	at_cmd(PSTR("AT&W"), PSTR("OK"), 1000);
+	eeprom_update_byte(&ee_baud_idx, baud_idx);
+	return baud_idx;
+}
+
+#if BENCH_BAUD
+#define BENCH_REPS	5
+const char bench_at[] PROGMEM = "AT";
+const char bench_csq[] PROGMEM = "AT+CSQ";
+const char bench_cmgr[] PROGMEM = "AT+CMGR=1";
+const char bench_sapbr[] PROGMEM = "AT+SAPBR=2,1";
+PGM_P const bench_cmds[] PROGMEM = {bench_at, bench_csq, bench_cmgr, bench_sapbr};
+
+//per-command round trip (first byte out to OK) at every rate, averaged over
+//BENCH_REPS; texted back as "<rate> AT:<ms> AT+CSQ:<ms> ..." one message per rate
+void bench_baud()
+{
+	char msg[80];
+	uint8_t home = baud_idx;
+	uint8_t idx, c, n;
+	uint32_t start;
+	uint16_t total;
+	PGM_P cmd;
+	
+	for (idx = 0; idx < BAUD_RATES; idx++)
+	{
+		if (!switch_baud(idx))
+		{
+			continue;
+		}
+		strcpy_P(msg, baud_table[idx].ipr + 7);
+		for (c = 0; c < sizeof bench_cmds / sizeof bench_cmds[0]; c++)
+		{
+			cmd = (PGM_P)pgm_read_ptr(&bench_cmds[c]);
+			total = 0;
+			for (n = 0; n < BENCH_REPS; n++)
+			{
+				start = millis();
+				at_cmd(cmd, PSTR("OK"), 2000);
+				total += (uint16_t)(millis() - start);
+			}
+			strcat(msg, " ");
+			strcat_P(msg, cmd);
+			strcat(msg, ":");
+			append_u16(msg, total / BENCH_REPS);
+		}
+		send_data_sms(msg);
+		delete_sms();
+	}
+	switch_baud(home);
+}
+#endif
+
+/********************************************************************************/
+/********************************************************************************/
+
+/***********************************read SMS*************************************/
+/********************************************************************************/
+//be sure to delete all messages initially (when unit powers on)
+//this means there won't be any saved commands.
+//also be sure to run set_textmode as well
+void read_SMS(uint8_t index)
+{
+	char num[4] = "";
+	
+	append_u16(num, index);
+	modem_acquire();
+	rx_clear();
+	Tx_USART_pgm_data(PSTR("AT+CMGR=")); //accessing the register +CMTI gave
+	Tx_USART_ram_data(num);
+	Tx_USART(carr_rtn);
+	wait_response(PSTR("\r\nOK\r\n"), 5000);	//the reply's final OK, not one in the text; max response time
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/*************************get control from SMS***********************************/
+/********************************************************************************/
+//run directly after read_sms to get a ctrl word: the first line of the text, after the
+//+CMGR: header (sms_body() in sensor_core.h); "" if the register was empty.
+char* get_ctrl()
+{
+	return (char *)sms_body(data_received);  //be sure to set text mode and show all text data!
+}
+/********************************************************************************/
+/********************************************************************************/
+
+
+/****************************pole sampling*************************************/
+/********************************************************************************/
+//both poles are read on their own adaptive schedules (sampler in sensor_core.h): every
+//few minutes while the resistance is steady, every SAMPLE_MIN_S while it moves.  The
+//readings are taken by pole acquisition; this queues a batch post for each ring that
+//has readings and none on the way.  A pole with a report schedule (sensor_core.h, SMS P)
+//instead holds its readings for the next slot, takes one more there, and posts them;
+//the other pole's report is waited for up to REPORT_ALIGN_S so both go in one wake.
+#define BOOT_SAMPLE_MS	1000
+#define REPORT_ALIGN_S	120
+
+struct schedule report[2];
+struct schedule ee_report[2] EEMEM;		//kept across resets, written by SMS P only when it changes
+uint32_t report_slot[2];				//slot the last report was for
+uint8_t report_utc = 0;					//report_slot[] counts on UTC (else uptime)
+uint8_t report_due[2];					//a slot came and its batch hasn't gone
+uint32_t report_due_at[2];				//uptime it came
+
+//seconds report slots count on: UTC, or uptime before the clock syncs
+uint32_t report_now()
+{
+	uint32_t epoch = clock_epoch_at(clock_stamp());
+	
+	return epoch ? epoch : uptime();
+}
+
+//count slots from now on whichever time report_now() is on, without reporting; at boot
+//and when the first clock sync moves slots from uptime to UTC
+void report_rebase()
+{
+	uint8_t n;
+	
+	report_utc = clock_anchor_epoch != 0;
+	for (n = 0; n < 2; n++)
+	{
+		if (report[n].every_s)
+		{
+			report_slot[n] = schedule_slot(&report[n], report_now());
+		}
+	}
+}
+
+void init_sampling()
+{
+	uint8_t n;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		sampler_init(&pole_sampler[0], SAMPLE_MIN_S, SAMPLE_MAX_S, uptime_s);
+		sampler_init(&pole_sampler[1], SAMPLE_MIN_S, SAMPLE_MAX_S, uptime_s);
+	}
+	eeprom_read_block(report, ee_report, sizeof report);
+	for (n = 0; n < 2; n++)
+	{
+		if (!schedule_valid(&report[n]))
+		{
+			memset(&report[n], 0, sizeof report[n]);		//never set: report as readings come
+		}
+	}
+	report_rebase();
+}
+
+//1 if a batch for this data endpoint is queued or in flight
+uint8_t batch_pending(uint8_t ep)
+{
+	uint8_t i;
+	
+	if (up.state != UP_IDLE && up.msg.ep == ep && up_ring(&up.msg))
+	{
+		return 1;
+	}
+	for (i = 0; i < OUTQ_DEPTH; i++)
+	{
+		if (outq.slot[i].len && outq.slot[i].ep == ep && up_ring(&outq.slot[i]))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//read pole n (0 or 1) now, outside its schedule, and queue the reading
+void sample_now(uint8_t n)
+{
+	uint16_t ohms = adc_to_ohms(n ? CAL_CH2 : CAL_CH1, acq_read(n));
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ring_push(&pole_ring[n], ohms, clock_stamp());
+	}
+}
+
+//take a reading at each scheduled pole's slot and mark its report due
+void report_poll()
+{
+	uint32_t epoch = clock_epoch_at(clock_stamp());
+	uint32_t slot;
+	uint8_t n;
+	
+	if (report_utc != (clock_anchor_epoch != 0))
+	{
+		report_rebase();				//uptime slot numbers mean nothing on UTC
+		return;
+	}
+	for (n = 0; n < 2; n++)
+	{
+		if (!report[n].every_s)
+		{
+			continue;
+		}
+		slot = schedule_slot(&report[n], report_now());
+		if ((int32_t)(slot - report_slot[n]) <= 0)
+		{
+			continue;					//same slot, or a resync stepped the clock back over a boundary
+		}
+		report_slot[n] = slot;
+		if (!schedule_active(&report[n], epoch))
+		{
+			continue;
+		}
+		sample_now(n);
+		if (!report_due[n])
+		{
+			report_due[n] = 1;
+			report_due_at[n] = uptime();
+		}
+	}
+}
+
+//1 if pole n's batch may go now: it has no schedule, or its report is due and so is
+//the other pole's (or that one isn't scheduled, or it has waited REPORT_ALIGN_S)
+uint8_t report_ready(uint8_t n)
+{
+	uint8_t other = !n;
+	
+	if (!report[n].every_s)
+	{
+		return 1;
+	}
+	if (!report_due[n])
+	{
+		return 0;
+	}
+	return !report[other].every_s || report_due[other] || uptime() - report_due_at[n] >= REPORT_ALIGN_S;
+}
+
+void sample_poll()
+{
+	uint8_t n;
+	uint8_t ep;
+	uint8_t waiting;
+	
+	report_poll();
+	for (n = 0; n < 2; n++)
+	{
+		ep = n ? EP_DATA2 : EP_DATA1;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			waiting = pole_ring[n].n - pole_ring[n].pinned;
+		}
+		if (!waiting || batch_pending(ep) || !report_ready(n))
+		{
+			continue;
+		}
+		if (!link_allows(n))
+		{
+			link_held[n] = 1;
+			continue;
+		}
+		if (link_held[n])
+		{
+			link_deferred(&link, batch_encode(&pole_ring[n], waiting, 0));
+			link_held[n] = 0;
+		}
+		outq_push(&outq, PRIO_TELEMETRY, ep, "B", 1, clock_stamp());	//body comes from the ring
+		report_due[n] = 0;
+	}
+}
+
+//"LINK csq:<average> reg:<0/1> good:<0/1> poor:<samples> held:<batches>/<bytes>B post:<poor>/<good>ms saved:<uAh>uAh"
+//texted back on DIAG_REQ
+void send_link_diag()
+{
+	char msg[128];
+	
+	strcpy_P(msg, PSTR("LINK csq:"));
+	append_u16(msg, link.rssi_q2 / 4);
+	strcat_P(msg, PSTR(" reg:"));
+	append_u16(msg, link.registered);
+	strcat_P(msg, PSTR(" good:"));
+	append_u16(msg, link.good);
+	strcat_P(msg, PSTR(" poor:"));
+	append_u16(msg, link.poor_samples);
+	strcat_P(msg, PSTR(" held:"));
+	append_u16(msg, link.deferred);
+	strcat(msg, "/");
+	append_u32(msg, link.deferred_bytes);
+	strcat_P(msg, PSTR("B post:"));
+	append_u32(msg, link.post_ms[0]);
+	strcat(msg, "/");
+	append_u32(msg, link.post_ms[1]);
+	strcat_P(msg, PSTR("ms saved:"));
+	append_u32(msg, link_saved_uah(&link, energy.ua[PWR_MODEM] / 100));
+	strcat_P(msg, PSTR("uAh"));
+	send_data_sms(msg);
+}
+
+//"SAMPLE 1:<min>-<max>s at:<s> n:<readings> up:<speedups> q:<max>/<drops>/<throttled> 2:..."
+//texted back on DIAG_REQ and SAMPLE_REQ
+void send_sample_diag()
+{
+	char msg[128];
+	struct sampler s;
+	struct sample_ring q;
+	uint8_t n;
+	
+	strcpy_P(msg, PSTR("SAMPLE"));
+	for (n = 0; n < 2; n++)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			s = pole_sampler[n];
+			q = pole_ring[n];
+		}
+		strcat_P(msg, n ? PSTR(" 2:") : PSTR(" 1:"));
+		append_u16(msg, s.min_s);
+		strcat(msg, "-");
+		append_u16(msg, s.max_s);
+		strcat_P(msg, PSTR("s at:"));
+		append_u16(msg, s.interval_s);
+		strcat_P(msg, PSTR(" n:"));
+		append_u16(msg, s.samples);
+		strcat_P(msg, PSTR(" up:"));
+		append_u16(msg, s.speedups);
+		strcat_P(msg, PSTR(" q:"));
+		append_u16(msg, q.max);
+		strcat(msg, "/");
+		append_u16(msg, q.drops);
+		strcat(msg, "/");
+		append_u16(msg, q.throttled);
+	}
+	send_data_sms(msg);
+}
+
+//SAMPLE_REQ arguments "<pole> <min_s> <max_s>", e.g. "1 30 3600"
+void sample_config(char *arg)
+{
+	uint8_t n = *arg - '1';
+	uint16_t lo;
+	uint16_t hi;
+	
+	if (n > 1 || !sampler_parse(arg + 1, &lo, &hi))
+	{
+		send_data_sms("O<pole> <min_s> <max_s>");
+		return;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		sampler_bounds(&pole_sampler[n], lo, hi);
+	}
+	send_sample_diag();
+}
+
+//"REPORT 1:<every>s+<phase>s <from>-<to>h 2:..." texted back on REPORT_REQ and DIAG_REQ
+void send_report_diag()
+{
+	char msg[64];
+	uint8_t n;
+	
+	strcpy_P(msg, PSTR("REPORT"));
+	for (n = 0; n < 2; n++)
+	{
+		strcat_P(msg, n ? PSTR(" 2:") : PSTR(" 1:"));
+		if (!report[n].every_s)
+		{
+			strcat_P(msg, PSTR("off"));
+			continue;
+		}
+		append_u16(msg, report[n].every_s);
+		strcat_P(msg, PSTR("s+"));
+		append_u16(msg, report[n].phase_s);
+		strcat_P(msg, PSTR("s "));
+		append_u16(msg, report[n].from_h);
+		strcat(msg, "-");
+		append_u16(msg, report[n].to_h);
+		strcat(msg, "h");
+	}
+	send_data_sms(msg);
+}
+
+//"<pole> <every_s> [<phase_s> [<from_h>-<to_h>]]" from SMS P; every_s 0 turns it off
+void report_config(char *arg)
+{
+	struct schedule s;
+	uint8_t n = *arg - '1';
+	
+	if (n > 1 || !schedule_parse(&s, arg + 1))
+	{
+		send_data_sms("P<pole> <every_s> [<phase_s> [<from_h>-<to_h>]]");
+		return;
+	}
+	report[n] = s;
+	report_due[n] = 0;
+	if (s.every_s)
+	{
+		report_slot[n] = schedule_slot(&s, report_now());
+	}
+	eeprom_update_block(&report[n], &ee_report[n], sizeof report[n]);
+	send_report_diag();
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/****************************RAM diagnostics*************************************/
+/********************************************************************************/
+//everything between the end of .bss (_end) and the top of RAM is painted with
+//STACK_CANARY before main runs; the stack eats into it from the top, so the
+//untouched run left above _end is the stack high-water mark.
+//tools/sram_report.sh is the build-time half of this (per-symbol .data/.bss budgets).
+#define STACK_CANARY	0xC5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+//runs from .init1, before the stack pointer and r1 are set up, so registers only
+void stack_paint(void) __attribute__ ((naked, used, section (".init1")));
+void stack_paint(void)
+{
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, lo8(0xC5)\n"		//STACK_CANARY
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		::);
+}
+
+//bytes between .bss and the deepest the stack has ever been
+uint16_t stack_unused()
+{
+	const uint8_t *p = &_end;
+	uint16_t unused = 0;
+	
+	while (p <= &__stack && *p == STACK_CANARY)
+	{
+		p++;
+		unused++;
+	}
+	return unused;
+}
+
+//"RAM static:<.data+.bss> free:<SP to .bss now> min:<stack high-water>" texted back on DIAG_REQ
+void send_ram_diag()
+{
+	char msg[48];
+	
+	strcpy(msg, "RAM static:");
+	append_u16(msg, (uint16_t)(&_end - (uint8_t *)RAMSTART));
+	strcat(msg, " free:");
+	append_u16(msg, SP - (uint16_t)&_end);
+	strcat(msg, " min:");
+	append_u16(msg, stack_unused());
+	send_data_sms(msg);
+}
+
+//"Q n:<queued> max:<deepest> f:<merged>/<dropped> a:.. t:.." texted back on DIAG_REQ
+void send_queue_diag()
+{
+	char msg[80];
+	uint8_t c;
+	
+	strcpy_P(msg, PSTR("Q n:"));
+	append_u16(msg, outq.len);
+	strcat_P(msg, PSTR(" max:"));
+	append_u16(msg, outq.max);
+	for (c = 0; c < PRIO_CLASSES; c++)
+	{
+		strcat_P(msg, c == PRIO_FAULT ? PSTR(" f:") : c == PRIO_ACK ? PSTR(" a:") : PSTR(" t:"));
+		append_u16(msg, outq.stats[c].merge);
+		strcat(msg, "/");
+		append_u16(msg, outq.stats[c].drop);
+	}
+	send_data_sms(msg);
+}
+
+//"MODEM awake:<s> sleep:<s> wakes:<n> mAh:<n>" texted back on DIAG_REQ; mAh is the
+//modem's share of the energy accounting (awake, asleep and GPRS)
+void send_modem_diag()
+{
+	char msg[80];
+	uint32_t uah;
+	
+	modem_pwr_sync();
+	energy_sync();
+	uah = energy_uah(&energy, PWR_MODEM) + energy_uah(&energy, PWR_MODEM_SLEEP) + energy_uah(&energy, PWR_GPRS);
+	strcpy_P(msg, PSTR("MODEM awake:"));
+	append_u32(msg, modem_pwr_s[MODEM_AWAKE]);
+	strcat_P(msg, PSTR(" sleep:"));
+	append_u32(msg, modem_pwr_s[MODEM_ASLEEP]);
+	strcat_P(msg, PSTR(" wakes:"));
+	append_u16(msg, modem_wakes);
+	strcat_P(msg, PSTR(" mAh:"));
+	append_u32(msg, uah / 1000);
+	send_data_sms(msg);
+}
+
+//start the entry " <tag>:" in msg (SMS_LEN + 1) for up to need characters; if it wouldn't
+//fit in the text, the text so far is sent and msg starts over with prefix
+void diag_entry(char *msg, PGM_P prefix, PGM_P tag, uint8_t need)
+{
+	uint8_t n = strlen(msg);
+	
+	if (n + need > SMS_LEN)
+	{
+		send_data_sms(msg);
+		strcpy_P(msg, prefix);
+		n = strlen(msg);
+	}
+	msg[n] = ' ';
+	msg[n+1] = pgm_read_byte(&tag[0]);
+	msg[n+2] = pgm_read_byte(&tag[1]);
+	msg[n+3] = ':';
+	msg[n+4] = '\0';
+}
+
+#define PWR_DIAG_ENTRY		14		//" ac:4294967295"
+#define OPS_DIAG_ENTRY		25		//" ps:4294967295/4294967295"
+
+//"PWR <h>h mAh:<total> uAh/h:<average> ac:<uAh> id:<uAh> ..." per power state, texted back on
+//DIAG_REQ; what doesn't fit in one text goes on in a second "PWR ..."
+void send_energy_diag()
+{
+	char msg[SMS_LEN + 1];
+	uint32_t total = 0;
+	uint32_t uah;
+	uint32_t min;
+	uint8_t s;
+	
+	energy_sync();
+	strcpy_P(msg, PSTR("PWR "));
+	append_u32(msg, uptime() / 3600);
+	strcat_P(msg, PSTR("h mAh:"));
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		total += energy_uah(&energy, s);
+	}
+	append_u32(msg, total / 1000);
+	strcat_P(msg, PSTR(" uAh/h:"));
+	min = uptime() / 60;
+	append_u32(msg, min ? total / min * 60 : 0);
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		uah = energy_uah(&energy, s);
+		diag_entry(msg, PSTR("PWR"), &pwr_tag[2*s], PWR_DIAG_ENTRY);
+		append_u32(msg, uah);
+	}
+	send_data_sms(msg);
+}
+
+//"OPS ot:<uAh> bo:<n>/<uAh> ps:<n>/<uAh> ..." charge per operation, texted back on DIAG_REQ;
+//two texts when the counters are large
+void send_op_diag()
+{
+	char msg[SMS_LEN + 1];
+	uint8_t op;
+	
+	energy_sync();
+	strcpy_P(msg, PSTR("OPS"));
+	for (op = 0; op < OPS; op++)
+	{
+		diag_entry(msg, PSTR("OPS"), &op_tag[2*op], OPS_DIAG_ENTRY);
+		if (op != OP_OTHER)
+		{
+			append_u32(msg, energy.op_n[op]);
+			strcat(msg, "/");
+		}
+		append_u32(msg, energy.op_uah[op]);
+	}
+	send_data_sms(msg);
+}
+
+//"UA ac:<uA> id:<uA> ..." the currents the accounting uses, texted back on ENERGY_REQ
+void send_pwr_config()
+{
+	char msg[128];
+	uint8_t s;
+	uint8_t n;
+	
+	strcpy_P(msg, PSTR("UA"));
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		n = strlen(msg);
+		msg[n] = ' ';
+		msg[n+1] = pgm_read_byte(&pwr_tag[2*s]);
+		msg[n+2] = pgm_read_byte(&pwr_tag[2*s + 1]);
+		msg[n+3] = ':';
+		msg[n+4] = '\0';
+		append_u32(msg, energy.ua[s]);
+	}
+	send_data_sms(msg);
+}
 
-void send_data_url(char *control_2, char *data_2)
+//"[<state> <uA>]" from SMS Q, e.g. "gp 350000"; kept in EEPROM
+void energy_config(char *arg)
 {
-	int i = 0;
-	if((strcmp(control_2, pole_1)==0))
-		{
-			init_ADC(POLE1);
-			data_ch1 = read_ADC();
-			bin_ascii(data_ch1, data1);
-			init_url(ip_data1);
-			for (i = 0; i <8; i++)
-			{
-				Tx_USART(data1[i]);
-			}
-			delay_2s();
-			Tx_USART_ram_data(post);
-			Tx_USART(carr_rtn);
-			delay_1s();
-		}
+	uint8_t s;
+	uint32_t ua;
 	
-	if((strcmp(control_2, pole_2)==0))
+	if (!sms_end(arg))
 	{
-		init_ADC(POLE2);
-		data_ch2 = read_ADC();
-		bin_ascii(data_ch2, data2);
-		init_url(ip_data2);
-		for (i = 0; i <8; i++)
+		if (!pwr_parse(arg, &s, &ua))
 		{
-			Tx_USART(data2[i]);
+			send_data_sms("Q<ac|id|ad|tx|rx|mo|ms|gp> <uA>");
+			return;
 		}
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		energy_sync();					//what went before at the old current
+		energy.ua[s] = ua;
+		eeprom_update_dword(&ee_pwr_ua[s], ua);
 	}
+	send_pwr_config();
+}
 
-	if((strcmp(control_2, poles)==0))
+#define HTTP_DIAG_ENTRY		21		//" d1:65535/65535/65535"
+
+//"HTTP d1:<ok>/<retry>/<drop> d2:..." texted back on DIAG_REQ; endpoints never posted to
+//are left out, and what doesn't fit in one text goes in a second
+void send_http_diag()
+{
+	char msg[SMS_LEN + 1];
+	uint8_t ep;
+	
+	strcpy_P(msg, PSTR("HTTP"));
+	for (ep = 0; ep < EP_COUNT; ep++)
 	{
-		init_ADC(POLE1);
-		data_ch1 = read_ADC();
-		bin_ascii(data_ch1, data1);
-		init_ADC(POLE2);
-		data_ch2 = read_ADC();
-		bin_ascii(data_ch2, data2);
-		init_url(ip_data2);
-		for (i = 0; i <8; i++)
+		if (!http_stats[ep].ok && !http_stats[ep].retry && !http_stats[ep].drop)
 		{
-			Tx_USART(data2[i]);
+			continue;					//never posted to
 		}
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
-		init_url(ip_data2);
-		for (i = 0; i <8; i++)
-		{
-			Tx_USART(data2[i]);
-		}
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
-		
+		diag_entry(msg, PSTR("HTTP"), &endpoint_tag[2*ep], HTTP_DIAG_ENTRY);
+		append_u16(msg, http_stats[ep].ok);
+		strcat(msg, "/");
+		append_u16(msg, http_stats[ep].retry);
+		strcat(msg, "/");
+		append_u16(msg, http_stats[ep].drop);
 	}
+	send_data_sms(msg);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************command dispatch**********************************/
+/********************************************************************************/
+//a text holds one or more commands separated by ';'.  Each is its letter, then for the
+//reads I, J and K an optional count and spacing:
+//	I			one pole 1 reading, posted now
+//	I20			20 readings, READ_EVERY_MS apart
+//	I20@1000	20 readings, 1000 ms apart
+//	I*@60000	a reading every minute until cancelled (subscription)
+//	I0			cancel
+//counts go up to READ_COUNT_MAX and spacings to a day (read_parse() in sensor_core.h);
+//anything else, or anything after them, gets the usage text back.
+//readings from a count go through the pole ring, so they leave as batch posts.
+//the rest of the command (O's bounds, P's schedule, Q's current, L's names) is left to
+//the command.
+//light commands run first, as soon as the text is read: the pins change in microseconds
+//and everything slow (acks, the SMS delete, other commands) comes after or in the
+//background.  Timer3 runs free at 2MHz to time it (parse-to-pin, SMS L cmd).
+#define READ_EVERY_MS		1000
+#define READ_SUBSCRIBE_MS	60000	//spacing of a subscription given without one
+#define READ_MIN_MS			250
+
+//light command args: which pins go which way
+#define SET_1_ON	0x01
+#define SET_1_OFF	0x02
+#define SET_2_ON	0x04
+#define SET_2_OFF	0x08
+
+struct cmd_args
+{
+	uint16_t count;			//1 if none was given, READ_FOREVER for '*'
+	uint32_t every_ms;		//0 if none was given
+	char *rest;
+};
+
+struct read_job
+{
+	uint16_t left;			//readings still to take
+	uint32_t every_ms;
+	uint32_t last;			//millis() of the last reading
+};
+struct read_job read_job[2];
+
+struct cmd_latency
+{
+	uint16_t last_us;		//parse-to-pin of the last light command
+	uint16_t max_us;
+	uint16_t n;
+};
+struct cmd_latency cmd_latency;
+uint16_t cmd_t0;			//TCNT3 when the text started being parsed
+
+void init_cmd_timer()
+{
+	TCCR3A = 0;
+	TCCR3B = (1<<CS31);		//clk/8: 0.5us per count, wraps every 32ms
+}
+
+//"CMD pin:<last>us max:<max>us n:<light commands>" texted back on DIAG_REQ
+void send_cmd_diag()
+{
+	char msg[48];
 	
-	if((strcmp(control_2, bad_res)==0)&&(strcmp(data_2, pole_1)==0))
+	strcpy_P(msg, PSTR("CMD pin:"));
+	append_u16(msg, cmd_latency.last_us);
+	strcat_P(msg, PSTR("us max:"));
+	append_u16(msg, cmd_latency.max_us);
+	strcat_P(msg, PSTR("us n:"));
+	append_u16(msg, cmd_latency.n);
+	send_data_sms(msg);
+}
+
+//A-H: set the lights and ack each one that was set
+void cmd_lights(uint8_t set, struct cmd_args *a)
+{
+	if (set & SET_1_ON)
 	{
-		init_url(ip_bad_contact1);
-		Tx_USART_ram_data("0");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
-		
+		PORTB &= ~CTRL_1;
 	}
-	if((strcmp(control_2, bad_res)==0)&&(strcmp(data_2, pole_2)==0))
+	if (set & SET_1_OFF)
 	{
-		init_url(ip_bad_contact2);
-		Tx_USART_ram_data("0");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		PORTB |= CTRL_1;
 	}
-	
-	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, pole_1)==0))
+	if (set & SET_2_ON)
 	{
-		init_url(ip_stat1);
-		Tx_USART_ram_data("true");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
-	}	
-	
-	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, pole_2)==0))
+		PORTB &= ~CTRL_2;
+	}
+	if (set & SET_2_OFF)
 	{
-		init_url(ip_stat2);
-		Tx_USART_ram_data("true");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		PORTB |= CTRL_2;
 	}
-	
-	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2,"1OFF")== 0))
+	cmd_latency.last_us = (uint16_t)(TCNT3 - cmd_t0) / 2;
+	if (cmd_latency.last_us > cmd_latency.max_us)
 	{
-		init_url(ip_stat1);
-		Tx_USART_ram_data("false");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		cmd_latency.max_us = cmd_latency.last_us;
 	}
-	
-	if((strcmp(control_2, light_status)==0)&&(strcmp(data_2, "2OFF")== 0))
+	cmd_latency.n++;
+	light_save();
+	if (set & (SET_1_ON | SET_1_OFF))
 	{
-		init_url(ip_stat2);
-		Tx_USART_ram_data("false");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		send_data_url((char *)light_status, set & SET_1_ON ? (char *)pole_1 : "1OFF");
 	}
-	
-	
-	if((strcmp(control_2, init_status1)==0))
+	if (set & (SET_2_ON | SET_2_OFF))
 	{
-		init_url(ip_initstat1);
-		Tx_USART_ram_data("true");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		send_data_url((char *)light_status, set & SET_2_ON ? (char *)pole_2 : "2OFF");
 	}
+}
+
+//I, J, K: which is pole 1, 2 or both (3)
+void cmd_read(uint8_t which, struct cmd_args *a)
+{
+	uint8_t n;
 	
-	if((strcmp(control_2, init_status2)==0))
+	if (a->count == 1 && !a->every_ms)
 	{
-		init_url(ip_initstat2);
-		Tx_USART_ram_data("true");
-		delay_2s();
-		Tx_USART_ram_data(post);
-		Tx_USART(carr_rtn);
-		delay_1s();
+		send_data_url(which == 3 ? (char *)poles : which == 2 ? (char *)pole_2 : (char *)pole_1, "");
+		return;
+	}
+	if (!a->every_ms)
+	{
+		a->every_ms = a->count == READ_FOREVER ? READ_SUBSCRIBE_MS : READ_EVERY_MS;
+	}
+	if (a->every_ms < READ_MIN_MS)
+	{
+		a->every_ms = READ_MIN_MS;
+	}
+	for (n = 0; n < 2; n++)
+	{
+		if (which & (1 << n))
+		{
+			read_job[n].left = a->count;
+			read_job[n].every_ms = a->every_ms;
+			read_job[n].last = millis() - a->every_ms;		//first one now
+		}
 	}
 }
 
+//M, N
+void cmd_capture(uint8_t pole, struct cmd_args *a)
+{
+	capture_run(pole == 2 ? POLE2 : POLE1, pole);
+}
 
-/********************************************************************************/
-/********************************************************************************/
+//O
+void cmd_sample(uint8_t unused, struct cmd_args *a)
+{
+	sample_config(a->rest);
+}
 
-/******************************** turn on GSM ***********************************/
-/********************************************************************************/
+//P
+void cmd_report(uint8_t unused, struct cmd_args *a)
+{
+	report_config(a->rest);
+}
 
-void on_gsm(){
-	//turn on gsm module
-	PORTB &= ~GSM_ON;
-	delay_2s();			//requires a 2sec low on key pin to turn on
-	delay_500m();
-	PORTB |= GSM_ON;
-	delay_2s();			//wait long time for power on notifications and sms notifications
-	delay_2s();
-	delay_2s();
-	delay_2s();
-	delay_2s();
-	delay_2s();	
-	ind = 0;			//reset after notifications
+//Q
+void cmd_energy(uint8_t unused, struct cmd_args *a)
+{
+	energy_config(a->rest);
 }
 
-/********************************************************************************/
-/********************************************************************************/
+//L: a text each, so only what's asked for; RAM/stack alone without a name
+struct diag
+{
+	char name[7];
+	void (*send)(void);
+};
 
-/**************************** turn off echo GSM *********************************/
-/********************************************************************************/
-void echo_off()
+const struct diag diags[] PROGMEM =
 {
-	Tx_USART_ram_data(no_echo);			//turn off echo
-	//delay_10m();
-	Tx_USART(carr_rtn);
-	delay_2s();
-	//strcpy(data_received, "\0");
-	ind = 0;
+	{"ram",		send_ram_diag},
+	{"http",	send_http_diag},
+	{"queue",	send_queue_diag},
+	{"modem",	send_modem_diag},
+	{"pwr",		send_energy_diag},
+	{"ops",		send_op_diag},
+	{"sample",	send_sample_diag},
+	{"report",	send_report_diag},
+	{"link",	send_link_diag},
+	{"sms",		send_sms_diag},
+	{"cmd",		send_cmd_diag},
+};
+#define DIAGS	(sizeof diags / sizeof diags[0])
+
+//L [<name> ...]: e.g. "L http pwr", "L all" for every one
+void cmd_diag(uint8_t unused, struct cmd_args *a)
+{
+	char *p = a->rest + strspn(a->rest, " ");
+	uint8_t len;
+	uint8_t all;
+	uint8_t hit;
+	uint8_t i;
+	
+	if (!*p)
+	{
+		send_ram_diag();
+		return;
+	}
+	while (*p)
+	{
+		len = strcspn(p, " ");
+		all = len == 3 && strncasecmp_P(p, PSTR("all"), 3) == 0;
+		hit = all;
+		for (i = 0; i < DIAGS; i++)
+		{
+			if (all || (len == strlen_P(diags[i].name) && strncasecmp_P(p, diags[i].name, len) == 0))
+			{
+				((void (*)(void))pgm_read_ptr(&diags[i].send))();
+				hit = 1;
+			}
+		}
+		if (!hit)
+		{
+			send_data_sms("L [ram|http|queue|modem|pwr|ops|sample|report|link|sms|cmd|all]");
+			return;
+		}
+		p += len;
+		p += strspn(p, " ");
+	}
 }
 
+#define CMD_COUNTED		0x01	//takes a count and spacing
+#define CMD_FAST		0x02	//runs ahead of the rest of the text
 
-/********************************************************************************/
-/********************************************************************************/
-
+struct command
+{
+	char letter;
+	uint8_t arg;
+	uint8_t flags;
+	void (*run)(uint8_t arg, struct cmd_args *a);
+};
 
-/***************************send data through sms *******************************/
-/********************************************************************************/
-//be sure to set text mode before use
-void send_data_sms(char *message)
+const struct command commands[] PROGMEM =
 {
-	Tx_USART_ram_data(num_cmd);
-	Tx_USART_ram_data(num);
-	Tx_USART(carr_rtn);
-	delay_10m();
-	Tx_USART_ram_data(message);
-	delay_10m();
-	Tx_USART(ctrl_z);
-	delay_1s();
-	ind = 0;
+	{LIGHT_1_CTRL_ON,		SET_1_ON,				CMD_FAST,		cmd_lights},
+	{LIGHT_1_CTRL_OFF,		SET_1_OFF,				CMD_FAST,		cmd_lights},
+	{LIGHT_2_CTRL_ON,		SET_2_ON,				CMD_FAST,		cmd_lights},
+	{LIGHT_2_CTRL_OFF,		SET_2_OFF,				CMD_FAST,		cmd_lights},
+	{LIGHTS_ON,				SET_1_ON | SET_2_ON,	CMD_FAST,		cmd_lights},
+	{LIGHTS_OFF,			SET_1_OFF | SET_2_OFF,	CMD_FAST,		cmd_lights},
+	{LIGHT2_ON_LIGHT1_OFF,	SET_1_OFF | SET_2_ON,	CMD_FAST,		cmd_lights},
+	{LIGHT1_ON_LIGHT2_OFF,	SET_1_ON | SET_2_OFF,	CMD_FAST,		cmd_lights},
+	{LIGHT_1_RES_REQ,		1,						CMD_COUNTED,	cmd_read},
+	{LIGHT_2_RES_REQ,		2,						CMD_COUNTED,	cmd_read},
+	{LIGHTS_RES_REQ,		3,						CMD_COUNTED,	cmd_read},
+	{DIAG_REQ,				0,						0,				cmd_diag},
+	{CAPTURE_1_REQ,			1,						0,				cmd_capture},
+	{CAPTURE_2_REQ,			2,						0,				cmd_capture},
+	{SAMPLE_REQ,			0,						0,				cmd_sample},
+	{REPORT_REQ,			0,						0,				cmd_report},
+	{ENERGY_REQ,			0,						0,				cmd_energy},
+};
+#define COMMANDS	(sizeof commands / sizeof commands[0])
+
+const struct command *cmd_find(char letter)
+{
+	const struct command *c;
+	
+	for (c = commands; c < commands + COMMANDS; c++)
+	{
+		if (pgm_read_byte(&c->letter) == letter)
+		{
+			return c;
+		}
+	}
+	return 0;
 }
 
-/********************************************************************************/
-/********************************************************************************/
-
-/********************************* set Text mode ********************************/
-/********************************************************************************/
-void set_Textmode()
+//run one command; text is what follows its letter
+void cmd_exec(const struct command *c, char *text)
 {
-	ind = 0;
-	Tx_USART_ram_data(text_mode);
-	Tx_USART(carr_rtn);
-	delay_100m();
-	ind = 0;
-	Tx_USART_ram_data(full_text);
-	Tx_USART(carr_rtn);
-	delay_100m();
+	struct cmd_args a;
+	void (*run)(uint8_t, struct cmd_args *);
+	
+	a.count = 1;
+	a.every_ms = 0;
+	if ((pgm_read_byte(&c->flags) & CMD_COUNTED) && !read_parse(text, &a.count, &a.every_ms))
+	{
+		send_data_sms("I|J|K[<count> or *][@<ms>]");
+		return;
+	}
+	a.rest = text;
+	run = (void (*)(uint8_t, struct cmd_args *))pgm_read_ptr(&c->run);
+	run(pgm_read_byte(&c->arg), &a);
 }
-/********************************************************************************/
-/********************************************************************************/
 
-/******************************power check GSM***********************************/
-/********************************************************************************/
-//returns 1 if power on; returns 0 if not powered on
-uint8_t pwr_chkGSM()
+//run every command in text (changed in place): the fast ones first, blanked out once
+//they've run, then the rest in order
+void cmd_run(char *text)
 {
-	ind = 0;
-	Tx_USART_ram_data(at);
-	Tx_USART(carr_rtn);
-	delay_1s();			//wait for receive to complete
-	if(data_received[2]=='O')	
+	const struct command *c;
+	char *next;
+	char *p;
+	
+	cmd_t0 = TCNT3;
+	for (p = text; p; p = next)
 	{
-		ind = 0;
-		return 1;
+		next = strchr(p, ';');
+		p += strspn(p, " ");
+		c = cmd_find(*p);
+		if (*p && c && (pgm_read_byte(&c->flags) & CMD_FAST))
+		{
+			cmd_exec(c, p + 1);
+			memset(p, ' ', next ? (size_t)(next - p) : strlen(p));
+		}
+		if (next)
+		{
+			next++;
+		}
+	}
+	for (p = text; p; p = next)
+	{
+		next = strchr(p, ';');
+		if (next)
+		{
+			*next++ = '\0';
+		}
+		p += strspn(p, " ");
+		if (!*p)
+		{
+			continue;
+		}
+		c = cmd_find(*p);
+		if (!c)
+		{
+			send_data_sms("NOT WORKING");
+			continue;
+		}
+		cmd_exec(c, p + 1);
 	}
-	return 0; //TEE HEE >:( -- Bear was here!
 }
 
-/********************************************************************************/
-/********************************************************************************/
-
-/******************************Delete all SMS************************************/
-/********************************************************************************/
-//be in text mode before calling this
-void delete_sms()
-{	
-	ind = 0;
-	Tx_USART_ram_data(delete_all);
-	Tx_USART(carr_rtn);
-	delay_2s();		//max response time
-	delay_2s();
+//delete the command text once the modem is free, rather than before acting on it
+void cmd_cleanup_poll()
+{
+	uint8_t n = sms_lowest(sms_done);
+	
+	if (n && !uploader_busy())
+	{
+		energy_sync();
+		energy_begin(&energy, OP_SMS_IN, 0);		//part of the SMS it deletes, not another one
+		delete_sms_at(n);
+		op_end(OP_SMS_IN);
+		sms_done &= ~(1UL << (n - 1));
+	}
 }
-/********************************************************************************/
-/********************************************************************************/
 
-/***********************************read SMS*************************************/
-/********************************************************************************/
-//be sure to delete all messages initially (when unit powers on)
-//this means there won't be any saved commands.
-//also be sure to run set_textmode as well
-void read_SMS()
+#if BENCH_CMD
+//runs each light command as if it had come in and texts back "CMD A:<us> B:<us> ...",
+//then puts the lights back (the acks on the way leave the server with that state)
+void bench_cmd()
 {
-	ind = 0;
-	//strcpy(data_received, "\0");	//must use for get_ctrl()'s strrchr() ref.
-	Tx_USART_ram_data(reg_1); //accessing register 1
-	Tx_USART(carr_rtn);
-	delay_2s();
+	char msg[64];
+	char text[2];
+	uint8_t home = light_state();
+	struct cmd_args a;
+	uint8_t n;
+	
+	strcpy_P(msg, PSTR("CMD"));
+	for (text[0] = LIGHT_1_CTRL_ON; text[0] <= LIGHT1_ON_LIGHT2_OFF; text[0]++)
+	{
+		text[1] = '\0';
+		cmd_run(text);
+		n = strlen(msg);
+		msg[n] = ' ';
+		msg[n+1] = text[0];
+		msg[n+2] = ':';
+		msg[n+3] = '\0';
+		append_u16(msg, cmd_latency.last_us);
+	}
+	cmd_lights((home & LIGHT_1 ? SET_1_ON : SET_1_OFF) | (home & LIGHT_2 ? SET_2_ON : SET_2_OFF), &a);
+	send_data_sms(msg);
 }
+#endif
 
-/********************************************************************************/
-/********************************************************************************/
-
-/*************************get control from SMS***********************************/
-/********************************************************************************/
-//run directly after read_sms to get a ctrl word.
-char* get_ctrl()
+//take the readings counted commands asked for
+void read_job_poll()
 {
-	char *place;
-	place = strrchr(data_received, ',');  //be sure to set text mode and show all text data!
-	place = place + 4;					  //now pointing at cmd_word if GSM set in text mode!
-	return place;
+	uint8_t n;
+	
+	for (n = 0; n < 2; n++)
+	{
+		if (read_job[n].left && millis() - read_job[n].last >= read_job[n].every_ms)
+		{
+			read_job[n].last += read_job[n].every_ms;
+			sample_now(n);
+			if (read_job[n].left != READ_FOREVER)
+			{
+				read_job[n].left--;
+			}
+		}
+	}
 }
+
 /********************************************************************************/
 /********************************************************************************/
 
@@ -733,25 +3191,33 @@ int main(void)
 {
 	//uint8_t data_ch1;	//holds adc data
 	//uint8_t data_ch2;	//holds adc data
-	char cmd_reg = '\0';	//register where sms is
+	uint8_t cmd_reg = 0;	//register where sms is
 	char cmd_word = '\0';	//data in text (a command word)
 	char *cmd;				//command text
+	char cmd_text[48];		//the command text (the reply buffer gets reused)
 	uint8_t point;
 	int i = 0;				//used for looping
+	uint32_t boot_start;
 	uint8_t ov_detect1;
 	uint8_t ov_detect2;
 	//char temp1[8] = {"\0"};
 	//char temp2[8] = {"\0"};
 	//char *data1 = temp1;
 	//char *data2 = temp2;
+	//initialize I/O first: the lights go back as they were before the reset
+	init_dio();
 	//setting CPU to 16Mhz.
 	CPU_PRESCALE(CPU_16MHz);
-	//initialize I/O		
-	init_dio();
 	//initialize ADC
 	init_ADC(POLE1);					//pinf4
 	//initialize USART
 	init_USART(BAUD);					//baud==103 for baud rate set to 9600
+	init_systick();
+	init_cmd_timer();
+	init_energy();
+	op_begin(OP_BOOT);
+	init_acquisition();
+	init_sampling();					//poles are sampled from here on, whatever the modem is doing
 
 	sei();								//ready to receive interrupts
 	
@@ -784,6 +3250,7 @@ int main(void)
 	delay_2s();
 	delay_2s();
 	ind = 0;
+	link_find();						//modem may be at a rate negotiated on an earlier boot
 	echo_off();
 	ind = 0;
 	delay_100m();
@@ -795,19 +3262,31 @@ int main(void)
 		Tx_USART(carr_rtn);
 		delay_2s();
 		ind = 0;
+		link_find();
 		echo_off();				
 		//ind = 0;
 	}
 	echo_off();							//for some unknown reason... :(
+	at_cmd(PSTR("AT+CLTS=1"), PSTR("OK"), 1000);	//network time into the modem RTC; saved by negotiate_baud()
+	negotiate_baud();
+	srand((uint16_t)millis() ^ acq_read(0));	//jitter for http_backoff()
 	
 	set_Textmode();
 	delete_sms();						//delete any commands received while off
 	ind = 0;							//in case text notifications received
+	init_modem_power();
+	link_init(&link);
+	clock_poll();						//first sync, so the init posts below carry a time
+#if BENCH_BAUD
+	bench_baud();
+#endif
+#if BENCH_CMD
+	bench_cmd();
+#endif
 	
-	send_data_url(init_status1, "true");
-	delete_sms();
-	ind = 0;
-	send_data_url(init_status2, "true");
+	send_data_url(init_status1, light_state() & LIGHT_1 ? "true" : "false");	//as restored by init_dio()
+	send_data_url(init_status2, light_state() & LIGHT_2 ? "true" : "false");
+	uploader_flush();
 	delete_sms();
 	ind = 0;
 	/**************************TESTING TEXT RECEIVE*****************************************/
@@ -884,8 +3363,10 @@ int main(void)
 	//ov_detect1 &= OV_DETECT1;			//masking out the over voltage detect
 	//ov_detect2 &= OV_DETECT2;
 	//*************MUSTHAVE************************************///
-	//sending 10 data samples for each resistance
-	for (i=0; i<10; i++)
+	//sending 10 data samples for each resistance, one every BOOT_SAMPLE_MS.  They wait in
+	//the ring and go up in batches while the next ones are taken
+	boot_start = millis();
+	for (i=0; i<10; )
 	{
 		//if (!ov_detect1)
 		//{
@@ -910,19 +3391,24 @@ int main(void)
 				//one_shot2 = 1;
 			//}
 		//}
-		change_input_ADC(POLE1);
-		data_ch1 = read_ADC();
+		if (millis() - boot_start >= (uint32_t)i * BOOT_SAMPLE_MS)
+		{
+			sample_now(0);
+			i++;
+		}
 		//change_input_ADC(POLE2);		//pinf5
 		//data_ch2 = read_ADC();
-		bin_ascii(data_ch1, data1);	//converting to ascii string 0b"xxxxxxxx"
 		////data2 = bin_ascii(data_ch2);
-		send_data_url(pole_1, data1);
-		delete_sms();
-		ind = 0;
+		sample_poll();
+		uploader_poll();
 		//send_data_url(pole_2, data2);
 		//delete_sms();
 		//ind = 0;
 	}
+	uploader_flush();
+	delete_sms();
+	ind = 0;
+	op_end(OP_BOOT);
 	//****************************************************************///
 	//
 	
@@ -962,126 +3448,38 @@ int main(void)
 			//}
 		//}	
 		//
-		if(ind > 13)
+		modem_power_poll(uplink_idle());
+		clock_poll();
+		sample_poll();
+		uploader_poll();					//posts go out in the background
+		sms_uplink_poll();					//or by SMS while GPRS is down
+		read_job_poll();
+		cmd_cleanup_poll();
+		energy_poll();
+		if(sms_new)
 		{
-			cmd_reg = data_received[14];  //location in sms received reply string with data register location
-			if(cmd_reg == '1')
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 			{
-				read_SMS();
-				ind = 0;
-				cmd = get_ctrl();
-				cmd_word = *cmd;
-				if(cmd_word > 64 && cmd_word < 76)  //A through I capitols matter!!!
-				{
-					delete_sms();
-					delay_2s();
-					switch (cmd_word)
-					{
-						case LIGHT_1_CTRL_ON:
-							PORTB &= ~CTRL_1;
-							send_data_url(light_status, pole_1);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT_1_CTRL_OFF:
-							PORTB |= CTRL_1;
-							send_data_url(light_status, "1OFF");
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT_2_CTRL_ON:
-							PORTB &= ~CTRL_2;
-							send_data_url(light_status, pole_2);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT_2_CTRL_OFF:
-							PORTB |= CTRL_2;
-							send_data_url(light_status, "2OFF");
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHTS_ON:
-							PORTB &= ~CTRL_1;
-							PORTB &= ~CTRL_2;
-							send_data_url(light_status, pole_1);
-							delete_sms();
-							ind = 0;
-							
-							send_data_url(light_status, pole_2);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHTS_OFF:
-							PORTB |= CTRL_1;
-							PORTB |= CTRL_2;
-							send_data_url(light_status, "1OFF");
-							delete_sms();
-							ind = 0;
-							
-							send_data_url(light_status, "2OFF");
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT2_ON_LIGHT1_OFF:
-							PORTB |= CTRL_1;
-							PORTB &= ~CTRL_2;
-							send_data_url(light_status, "1OFF");
-							delete_sms();
-							ind = 0;
-							send_data_url(light_status, pole_2);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT1_ON_LIGHT2_OFF:
-							PORTB &= ~CTRL_1;
-							PORTB |= CTRL_2;
-							send_data_url(light_status, pole_1);
-							delete_sms();
-							ind = 0;
-							send_data_url(light_status, "2OFF");
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT_1_RES_REQ:
-							change_input_ADC(POLE1);
-							data_ch1 = read_ADC();
-							//bin_ascii(data_ch1, data1);
-							send_data_url(pole_1, data1);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHT_2_RES_REQ:
-							change_input_ADC(POLE2);
-							data_ch2 = read_ADC();
-							//bin_ascii(data_ch2, data2);
-							send_data_url(pole_2, data2);
-							delete_sms();
-							ind = 0;
-						break;
-						case LIGHTS_RES_REQ:
-							change_input_ADC(POLE1);
-							data_ch1 = read_ADC();
-							//bin_ascii(data_ch1, data1);
-							send_data_url(pole_1, data1);
-							delete_sms();
-							ind = 0;
-							//change_input_ADC(POLE2);
-							//data_ch2 = read_ADC();
-							////bin_ascii(data_ch2, data2);
-							//send_data_url(pole_2, data2);
-							//delete_sms();
-							//ind = 0;
-						break;
-						default:
-							send_data_sms("NOT WORKING");
-							delete_sms();
-							ind = 0;
-						break;
-					}
-				}
+				cmd_reg = sms_lowest(sms_new);	//register from a +CMTI notification, oldest index first
+				sms_new &= ~(1UL << (cmd_reg - 1));
+			}
+			op_begin(OP_SMS_IN);
+			read_SMS(cmd_reg);
+			ind = 0;
+			cmd = get_ctrl();
+			cmd_word = *cmd;
+			strncpy(cmd_text, cmd, sizeof cmd_text - 1);
+			cmd_text[sizeof cmd_text - 1] = '\0';
+			cmd_text[strcspn(cmd_text, "\r\n")] = '\0';
+			if(cmd_word >= 'A' && cmd_word <= 'Z')  //capitols matter!!!
+			{
+				cmd_run(cmd_text);		//lights change here; acks go out in the background
 			}
+			sms_done |= 1UL << (cmd_reg - 1);	//deleted by cmd_cleanup_poll(), commands or not
+			ind = 0;
+			op_end(OP_SMS_IN);
 		}
+		cpu_idle();							//everything above is polled; an interrupt comes at least every ms
 	}
 	return 0;
 }
@@ -0,0 +1,41 @@
+/*
+ * cal_table.h
+ *
+ * Generated by tools/gen_caltab from tools/cal_nominal.txt -- do not edit.
+ * ADC code -> ohms, one point every 4 codes, OHMS_OPEN past the divider range.
+ * Channel 1: gain 1.0000, offset 0.00 codes, from 0 measurements.
+ * Channel 2: gain 1.0000, offset 0.00 codes, from 0 measurements.
+ */
+
+#define CAL_STEP_SHIFT	2
+#define CAL_POINTS		65
+#define OHMS_OPEN		0xFFFF
+
+#define CAL_CH1_RREF		1000		//divider resistor (ohms)
+#define CAL_CH2_RREF		1000		//divider resistor (ohms)
+
+const uint16_t cal_ohms_ch1[CAL_POINTS] PROGMEM =
+{
+	    0,    16,    32,    49,    67,    85,   103,   123,
+	  143,   164,   185,   208,   231,   255,   280,   306,
+	  333,   362,   391,   422,   455,   488,   524,   561,
+	  600,   641,   684,   730,   778,   829,   882,   939,
+	 1000,  1065,  1133,  1207,  1286,  1370,  1462,  1560,
+	 1667,  1783,  1909,  2048,  2200,  2368,  2556,  2765,
+	 3000,  3267,  3571,  3923,  4333,  4818,  5400,  6111,
+	 7000,  8143,  9667, 11800, 15000, 20333, 31000, 63000,
+	65535,
+};
+
+const uint16_t cal_ohms_ch2[CAL_POINTS] PROGMEM =
+{
+	    0,    16,    32,    49,    67,    85,   103,   123,
+	  143,   164,   185,   208,   231,   255,   280,   306,
+	  333,   362,   391,   422,   455,   488,   524,   561,
+	  600,   641,   684,   730,   778,   829,   882,   939,
+	 1000,  1065,  1133,  1207,  1286,  1370,  1462,  1560,
+	 1667,  1783,  1909,  2048,  2200,  2368,  2556,  2765,
+	 3000,  3267,  3571,  3923,  4333,  4818,  5400,  6111,
+	 7000,  8143,  9667, 11800, 15000, 20333, 31000, 63000,
+	65535,
+};
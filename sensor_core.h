@@ -0,0 +1,1153 @@
+/*
+ * sensor_core.h
+ *
+ * Firmware logic that doesn't touch the hardware, shared by Analog_Sensor.c and
+ * the host tools in tools/ (the host build).  Plain C only; program memory goes
+ * through the pgm_read_ macros, which are ordinary reads off the AVR.
+ */
+
+#ifndef SENSOR_CORE_H
+#define SENSOR_CORE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define PGM_P					const char *
+#define pgm_read_byte(p)		(*(const uint8_t *)(p))
+#define pgm_read_word(p)		(*(const uint16_t *)(p))
+#define pgm_read_dword(p)		(*(const uint32_t *)(p))
+#define pgm_read_ptr(p)			(*(const void * const *)(p))
+#define PSTR(s)					(s)
+#define strncmp_P				strncmp
+#endif
+
+#include "cal_table.h"				//ADC->ohms tables, generated by tools/gen_caltab
+
+
+/******************************ADC code to ohms**********************************/
+/********************************************************************************/
+#define CAL_CH1	0					//calibration table for POLE1 (see cal_table.h)
+#define CAL_CH2	1					//calibration table for POLE2
+
+//table lookup with linear interpolation between points; the tables live in flash
+//and are spaced 2^CAL_STEP_SHIFT codes apart so the interpolation is a shift, no division.
+//returns OHMS_OPEN when the reading is past the divider range (open contact)
+uint16_t adc_to_ohms(uint8_t cal_ch, uint8_t code)
+{
+	const uint16_t *table = (cal_ch == CAL_CH2) ? cal_ohms_ch2 : cal_ohms_ch1;
+	uint8_t idx = code >> CAL_STEP_SHIFT;
+	uint8_t frac = code & ((1<<CAL_STEP_SHIFT) - 1);
+	uint16_t lo = pgm_read_word(&table[idx]);
+	uint16_t hi = pgm_read_word(&table[idx + 1]);
+
+	if (hi == OHMS_OPEN && frac)
+	{
+		return OHMS_OPEN;
+	}
+	return lo + (uint16_t)(((uint32_t)(hi - lo) * frac) >> CAL_STEP_SHIFT);
+}
+
+const uint16_t pow10_tab[5] PROGMEM = {10000, 1000, 100, 10, 1};
+
+//ohms as 8 ascii digits (zero padded, same width as bin_ascii so the posts stay 8 bytes).
+//digits by repeated subtraction, no division on the 8-bit core
+void ohms_ascii(uint16_t ohms, char *data_t)
+{
+	uint8_t i;
+	uint16_t p;
+	char digit;
+
+	data_t[0] = '0';
+	data_t[1] = '0';
+	data_t[2] = '0';
+	for (i = 0; i < 5; i++)
+	{
+		p = pgm_read_word(&pow10_tab[i]);
+		digit = '0';
+		while (ohms >= p)
+		{
+			ohms -= p;
+			digit++;
+		}
+		data_t[3 + i] = digit;
+	}
+}
+
+const uint32_t pow10_tab32[10] PROGMEM = {1000000000, 100000000, 10000000, 1000000, 100000, 10000, 1000, 100, 10, 1};
+
+//append v in decimal (no leading zeros) to the string at dst
+void append_u32(char *dst, uint32_t v)
+{
+	uint8_t i;
+	uint8_t started = 0;
+	uint32_t p;
+	char digit;
+
+	dst += strlen(dst);
+	for (i = 0; i < 10; i++)
+	{
+		p = pgm_read_dword(&pow10_tab32[i]);
+		digit = '0';
+		while (v >= p)
+		{
+			v -= p;
+			digit++;
+		}
+		if (digit != '0' || started || i == 9)
+		{
+			*dst++ = digit;
+			started = 1;
+		}
+	}
+	*dst = '\0';
+}
+
+void append_u16(char *dst, uint16_t v)
+{
+	append_u32(dst, v);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/******************************network time**************************************/
+/********************************************************************************/
+const uint16_t days_before_month[12] PROGMEM = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
+
+//"yy/MM/dd,hh:mm:ss+zz" (zz in quarter hours, local = UTC + zz) to UTC seconds since 1970; 0 if implausible
+uint32_t clock_parse(const char *t)
+{
+	uint8_t yy = atoi(t);
+	uint8_t mo = atoi(t + 3);
+	uint8_t dd = atoi(t + 6);
+	int8_t tz = atoi(t + 17);			//atoi takes the sign
+	uint32_t days;
+
+	if (yy < 16 || mo < 1 || mo > 12 || dd < 1 || dd > 31)
+	{
+		return 0;						//modem RTC never set by the network (it resets to 04/01/01)
+	}
+	days = 10957 + 365UL*yy + (yy + 3)/4 + pgm_read_word(&days_before_month[mo - 1]) + dd - 1;	//10957 days 1970 to 2000
+	if (mo > 2 && (yy & 3) == 0)
+	{
+		days++;
+	}
+	return days*86400UL + atoi(t + 9)*3600UL + atoi(t + 12)*60UL + atoi(t + 15) - tz*900L;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/******************************endpoints*****************************************/
+/********************************************************************************/
+enum endpoint
+{
+	EP_DATA1, EP_DATA2, EP_STAT1, EP_STAT2, EP_INIT1, EP_INIT2, EP_BAD1, EP_BAD2, EP_WAVE1, EP_WAVE2, EP_COUNT
+};
+
+const char ep_data1[] PROGMEM = "/data1";
+const char ep_data2[] PROGMEM = "/data2";
+const char ep_stat1[] PROGMEM = "/update1";
+const char ep_stat2[] PROGMEM = "/update2";
+const char ep_init1[] PROGMEM = "/light1";					//use on start up, don't use again
+const char ep_init2[] PROGMEM = "/light2";
+const char ep_bad1[] PROGMEM = "/update1conctact";			//send a zero ascii
+const char ep_bad2[] PROGMEM = "/update2conctact";
+const char ep_wave1[] PROGMEM = "/wave1";					//compressed capture, tools/wave_decode.c reads it
+const char ep_wave2[] PROGMEM = "/wave2";
+
+PGM_P const endpoint_path[EP_COUNT] PROGMEM =
+{
+	ep_data1, ep_data2, ep_stat1, ep_stat2, ep_init1, ep_init2, ep_bad1, ep_bad2, ep_wave1, ep_wave2
+};
+const char endpoint_tag[] PROGMEM = "d1d2s1s2i1i2b1b2w1w2";	//two letters per endpoint for diagnostics
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/******************************outbound queue************************************/
+/********************************************************************************/
+//everything the device posts goes through here and is sent by the uploader.
+//most urgent class first, oldest first within a class
+#define OUTQ_DEPTH		8
+
+enum prio
+{
+	PRIO_FAULT, PRIO_ACK, PRIO_TELEMETRY, PRIO_CLASSES
+};
+
+struct out_msg
+{
+	uint8_t prio;
+	uint8_t seq;			//arrival order
+	uint8_t ep;				//enum endpoint
+	uint8_t len;			//0 marks a free slot
+	uint16_t stamp;			//clock stamp when queued
+	char body[8];
+};
+
+struct outq_count
+{
+	uint16_t merge;
+	uint16_t drop;
+};
+
+struct outq
+{
+	struct out_msg slot[OUTQ_DEPTH];
+	struct outq_count stats[PRIO_CLASSES];
+	uint8_t seq;
+	uint8_t len;
+	uint8_t max;			//deepest the queue has been
+};
+
+//1 if a arrived before b
+uint8_t outq_older(struct outq *q, struct out_msg *a, struct out_msg *b)
+{
+	return (uint8_t)(q->seq - a->seq) > (uint8_t)(q->seq - b->seq);
+}
+
+//queued message for an endpoint in a class, 0 if none
+struct out_msg *outq_find(struct outq *q, uint8_t prio, uint8_t ep)
+{
+	uint8_t i;
+
+	for (i = 0; i < OUTQ_DEPTH; i++)
+	{
+		if (q->slot[i].len && q->slot[i].prio == prio && q->slot[i].ep == ep)
+		{
+			return &q->slot[i];
+		}
+	}
+	return 0;
+}
+
+//queue a post.  A fault or ack for an endpoint that already has one queued replaces it
+//(only the latest state matters).  When full, the least urgent, oldest message is
+//dropped to make room, unless everything queued is more urgent than this one.
+//Returns the queued message, 0 if it was dropped
+struct out_msg *outq_push(struct outq *q, uint8_t prio, uint8_t ep, const char *body, uint8_t len, uint16_t stamp)
+{
+	struct out_msg *slot = 0;
+	struct out_msg *victim = 0;
+	struct out_msg *m;
+	uint8_t i;
+
+	if (prio != PRIO_TELEMETRY && (m = outq_find(q, prio, ep)))
+	{
+		memcpy(m->body, body, len);
+		m->len = len;
+		m->stamp = stamp;
+		q->stats[prio].merge++;
+		return m;
+	}
+	for (i = 0; i < OUTQ_DEPTH; i++)
+	{
+		m = &q->slot[i];
+		if (!m->len)
+		{
+			if (!slot)
+			{
+				slot = m;
+			}
+			continue;
+		}
+		if (!victim || m->prio > victim->prio || (m->prio == victim->prio && outq_older(q, m, victim)))
+		{
+			victim = m;
+		}
+	}
+	if (!slot)
+	{
+		if (victim->prio < prio)
+		{
+			q->stats[prio].drop++;
+			return 0;
+		}
+		q->stats[victim->prio].drop++;
+		q->len--;
+		slot = victim;
+	}
+	slot->prio = prio;
+	slot->seq = q->seq++;
+	slot->ep = ep;
+	slot->len = len;
+	slot->stamp = stamp;
+	memcpy(slot->body, body, len);
+	if (++q->len > q->max)
+	{
+		q->max = q->len;
+	}
+	return slot;
+}
+
+//most urgent queued message, 0 if empty
+struct out_msg *outq_head(struct outq *q)
+{
+	struct out_msg *best = 0;
+	struct out_msg *m;
+	uint8_t i;
+
+	for (i = 0; i < OUTQ_DEPTH; i++)
+	{
+		m = &q->slot[i];
+		if (m->len && (!best || m->prio < best->prio || (m->prio == best->prio && outq_older(q, m, best))))
+		{
+			best = m;
+		}
+	}
+	return best;
+}
+
+uint8_t outq_pop(struct outq *q, struct out_msg *dst)
+{
+	struct out_msg *head = outq_head(q);
+
+	if (!head)
+	{
+		return 0;
+	}
+	*dst = *head;
+	head->len = 0;
+	q->len--;
+	return 1;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/******************************HTTP retry policy*********************************/
+/********************************************************************************/
+//a post is HTTPDATA then HTTPACTION; a failed step is retried on its own with
+//exponential backoff and jitter, and the post is dropped after HTTP_TRIES failures
+#define HTTP_TRIES		3		//attempts per step before the post is dropped
+#define HTTP_BACKOFF_MS	1000	//first retry waits 0.5-1.5x this, doubling each retry
+#define HTTP_ACTION_MS	30000	//network side of HTTPACTION can take this long
+
+enum http_verdict
+{
+	HTTP_DONE, HTTP_RETRY, HTTP_GIVE_UP
+};
+
+//what to do about a +HTTPACTION status (0: none came back)
+uint8_t http_verdict(uint16_t status)
+{
+	if (status >= 200 && status < 300)
+	{
+		return HTTP_DONE;
+	}
+	if (status >= 400 && status < 500)
+	{
+		return HTTP_GIVE_UP;			//server refused it, retrying won't help
+	}
+	return HTTP_RETRY;					//no answer, 5xx, or 6xx (modem side network errors)
+}
+
+//wait before retry number tries (1 based)
+uint16_t http_backoff_ms(uint8_t tries)
+{
+	uint16_t d = HTTP_BACKOFF_MS << (tries - 1);
+	return d/2 + rand() % d;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+
+/******************************waveform encoding*********************************/
+/********************************************************************************/
+//burst capture upload:
+//	'W' <pole '1'/'2'> <rate Hz, 2 bytes LE> <samples, 2 bytes LE> <varint per sample>
+//each varint is the zigzagged difference from the previous sample (the first from 0),
+//7 bits a byte, high bit set on all but the last.  Encoded on the fly: emit gets each
+//byte (0 to only count them).  Returns the encoded length
+uint16_t wave_encode(const uint8_t *buf, uint16_t n, uint8_t pole, uint16_t hz, void (*emit)(uint8_t))
+{
+	uint8_t head[6] = {'W', '0' + pole, hz & 0xFF, hz >> 8, n & 0xFF, n >> 8};
+	uint16_t len = 0;
+	uint16_t i;
+	uint16_t z;
+	int16_t d;
+	uint8_t prev = 0;
+
+	for (i = 0; i < sizeof head; i++)
+	{
+		if (emit)
+		{
+			emit(head[i]);
+		}
+		len++;
+	}
+	for (i = 0; i < n; i++)
+	{
+		d = (int16_t)buf[i] - prev;
+		prev = buf[i];
+		z = (d < 0) ? ((uint16_t)(-d) << 1) - 1 : (uint16_t)d << 1;		//zigzag: 0,-1,1,-2.. -> 0,1,2,3..
+		while (z >= 0x80)
+		{
+			if (emit)
+			{
+				emit((z & 0x7F) | 0x80);
+			}
+			len++;
+			z >>= 7;
+		}
+		if (emit)
+		{
+			emit(z);
+		}
+		len++;
+	}
+	return len;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************received SMS**************************************/
+/********************************************************************************/
+//the text in an AT+CMGR reply (text mode, AT+CSDH=1):
+//	+CMGR: "REC UNREAD","+15551234567",,"26/10/19,12:00:00+00",145,4,0,0,"+15550000000",145,13\r\n
+//	P1 900 0 6-22\r\n\r\nOK\r\n
+//The header ends at the first line break after +CMGR:, however many digits the
+//length takes; "" if the reply has no message (empty register).
+const char *sms_body(const char *reply)
+{
+	const char *p;
+
+	for (p = reply; *p; p++)
+	{
+		if ((p == reply || p[-1] == '\n') && strncmp_P(p, PSTR("+CMGR:"), 6) == 0)
+		{
+			p = strchr(p, '\n');
+			return p ? p + 1 : "";
+		}
+	}
+	return "";
+}
+
+//unsigned number at *p after any spaces, moving *p past it; 0 if there are no digits
+//there or it doesn't fit in 32 bits
+uint8_t sms_number(const char **p, uint32_t *v)
+{
+	const char *c = *p + strspn(*p, " ");
+
+	if (*c < '0' || *c > '9')
+	{
+		return 0;
+	}
+	for (*v = 0; *c >= '0' && *c <= '9'; c++)
+	{
+		if (*v > (0xFFFFFFFFUL - 9) / 10)
+		{
+			return 0;
+		}
+		*v = *v * 10 + (*c - '0');
+	}
+	*p = c;
+	return 1;
+}
+
+//1 if only spaces are left
+uint8_t sms_end(const char *p)
+{
+	return !p[strspn(p, " ")];
+}
+
+//reads I, J and K: how many and how far apart
+#define READ_FOREVER		0xFFFF		//'*': until cancelled
+#define READ_COUNT_MAX		(READ_FOREVER - 1)
+#define READ_EVERY_MAX_MS	86400000UL	//a day
+
+//"[<count>|*][@<every_ms>]" as I, J and K take it; count 1 and every_ms 0 where not
+//given.  0 if it doesn't parse or is out of range
+uint8_t read_parse(const char *text, uint16_t *count, uint32_t *every_ms)
+{
+	uint32_t v;
+
+	*count = 1;
+	*every_ms = 0;
+	text += strspn(text, " ");
+	if (*text == '*')
+	{
+		*count = READ_FOREVER;
+		text++;
+	}
+	else if (*text >= '0' && *text <= '9')
+	{
+		if (!sms_number(&text, &v) || v > READ_COUNT_MAX)
+		{
+			return 0;
+		}
+		*count = v;
+	}
+	if (*text == '@')
+	{
+		text++;
+		if (!sms_number(&text, &v) || v > READ_EVERY_MAX_MS)
+		{
+			return 0;
+		}
+		*every_ms = v;
+	}
+	return sms_end(text);
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************adaptive sampling*********************************/
+/********************************************************************************/
+//each pole is read on its own schedule.  The interval drops to a quarter (down to min_s)
+//when the reading is moving: recent variance above SAMPLE_VAR, a change since the last
+//reading steeper than SAMPLE_SLOPE, or a contact opening or closing.  Each steady reading doubles it, up to max_s.
+//Variance is an exponentially weighted average over the last few readings.
+#define SAMPLE_MIN_S	10			//default bounds on the interval, seconds
+#define SAMPLE_MAX_S	900
+#define SAMPLE_VAR		400			//ohms^2 (20 ohms standard deviation, over an ADC step at 1k)
+#define SAMPLE_SLOPE	30			//ohms per minute
+#define SAMPLE_DEADBAND	20			//changes up to this are ADC jitter, not slope
+#define SAMPLE_WEIGHT	2			//averages weight a new reading 1/2^SAMPLE_WEIGHT
+
+struct sampler
+{
+	uint16_t min_s;
+	uint16_t max_s;
+	uint16_t interval_s;	//current interval
+	uint32_t due;			//next reading, seconds of uptime
+	uint32_t last_at;		//previous reading, 0 before the first
+	uint16_t last;			//previous reading, ohms
+	int32_t mean_q4;		//average, ohms x 16
+	uint32_t var;			//average squared deviation, ohms^2
+	uint16_t samples;
+	uint16_t speedups;		//times the interval was cut
+};
+
+void sampler_init(struct sampler *s, uint16_t min_s, uint16_t max_s, uint32_t now)
+{
+	memset(s, 0, sizeof *s);
+	s->min_s = min_s;
+	s->max_s = max_s;
+	s->interval_s = min_s;			//fast until the signal has shown it's steady
+	s->due = now;
+}
+
+//new bounds take effect from the next reading
+void sampler_bounds(struct sampler *s, uint16_t min_s, uint16_t max_s)
+{
+	s->min_s = min_s;
+	s->max_s = max_s;
+	if (s->interval_s < min_s)
+	{
+		s->interval_s = min_s;
+	}
+	if (s->interval_s > max_s)
+	{
+		s->interval_s = max_s;
+	}
+	if (s->samples && s->due > s->last_at + s->interval_s)
+	{
+		s->due = s->last_at + s->interval_s;
+	}
+}
+
+//"<min_s> <max_s>" as SMS O takes it after the pole; 0 if it doesn't parse or
+//isn't 1 <= min_s <= max_s <= 65535
+uint8_t sampler_parse(const char *arg, uint16_t *min_s, uint16_t *max_s)
+{
+	uint32_t lo, hi;
+
+	if (!sms_number(&arg, &lo) || !sms_number(&arg, &hi) || !sms_end(arg) || !lo || hi < lo || hi > 0xFFFF)
+	{
+		return 0;
+	}
+	*min_s = lo;
+	*max_s = hi;
+	return 1;
+}
+
+uint8_t sampler_due(struct sampler *s, uint32_t now)
+{
+	return (int32_t)(now - s->due) >= 0;
+}
+
+//take a reading in and schedule the next one; returns 1 if it was a busy reading
+uint8_t sampler_feed(struct sampler *s, uint16_t ohms, uint32_t now)
+{
+	int32_t d;
+	uint32_t step;
+	uint8_t busy;
+
+	s->samples++;
+	if (ohms == OHMS_OPEN || s->last == OHMS_OPEN || s->samples == 1)
+	{
+		busy = ohms == OHMS_OPEN || s->last == OHMS_OPEN;	//contact opened or came back
+		s->mean_q4 = (int32_t)ohms << 4;				//start the averages over
+		s->var = 0;
+	}
+	else
+	{
+		d = (int32_t)ohms - (s->mean_q4 >> 4);
+		if (d > 4096 || d < -4096)
+		{
+			d = d < 0 ? -4096 : 4096;			//keeps d*d in range; far past the threshold anyway
+		}
+		s->mean_q4 += (d << 4) >> SAMPLE_WEIGHT;
+		s->var += ((int32_t)(d*d) - (int32_t)s->var) >> SAMPLE_WEIGHT;
+		step = ohms > s->last ? ohms - s->last : s->last - ohms;
+		busy = s->var > SAMPLE_VAR ||
+			(step > SAMPLE_DEADBAND && step*60 > (uint32_t)SAMPLE_SLOPE*(now - s->last_at));
+	}
+	if (busy)
+	{
+		if (s->interval_s > s->min_s)
+		{
+			s->speedups++;
+		}
+		s->interval_s = s->interval_s/4 > s->min_s ? s->interval_s/4 : s->min_s;
+	}
+	else
+	{
+		s->interval_s = s->interval_s < s->max_s/2 ? s->interval_s*2 : s->max_s;
+	}
+	s->last = ohms;
+	s->last_at = now;
+	s->due = now + s->interval_s;
+	return busy;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************sample ring***************************************/
+/********************************************************************************/
+//readings waiting to go up, one ring per pole.  They are written as they are taken
+//and posted in batches, so sampling never waits on the link.  The oldest readings are
+//pinned while a batch with them is in flight; when the ring is full new readings are
+//dropped, and past RING_HIGH the sampler is held back (backpressure).
+#define RING_LEN	16
+#define RING_HIGH	(RING_LEN/2)
+
+struct reading
+{
+	uint16_t stamp;			//clock stamp when taken
+	uint16_t ohms;
+};
+
+struct sample_ring
+{
+	struct reading r[RING_LEN];
+	uint8_t head;			//oldest reading
+	uint8_t n;				//readings held
+	uint8_t pinned;			//oldest readings in the batch in flight
+	uint8_t max;			//deepest the ring has been
+	uint16_t drops;			//readings lost to a full ring
+	uint16_t throttled;		//readings that held the sampler back
+};
+
+struct reading *ring_at(struct sample_ring *q, uint8_t i)
+{
+	return &q->r[(q->head + i) % RING_LEN];
+}
+
+//0 if the ring was full and the reading was dropped
+uint8_t ring_push(struct sample_ring *q, uint16_t ohms, uint16_t stamp)
+{
+	struct reading *r;
+
+	if (q->n == RING_LEN)
+	{
+		q->drops++;
+		return 0;
+	}
+	r = ring_at(q, q->n);
+	r->stamp = stamp;
+	r->ohms = ohms;
+	if (++q->n > q->max)
+	{
+		q->max = q->n;
+	}
+	return 1;
+}
+
+//the batch in flight is done with (sent or given up on)
+void ring_release(struct sample_ring *q)
+{
+	q->head = (q->head + q->pinned) % RING_LEN;
+	q->n -= q->pinned;
+	q->pinned = 0;
+}
+
+//batch body, oldest first: "<8 digit ohms>" for the first reading, then
+//",<8 digit ohms>+<seconds after the first>" for each after it.  One reading is the
+//same body as a single post.  emit gets each byte (0 to only count them)
+uint16_t batch_encode(struct sample_ring *q, uint8_t n, void (*emit)(uint8_t))
+{
+	char buf[16];
+	uint16_t len = 0;
+	uint8_t i;
+	uint8_t j;
+	uint8_t k;
+
+	for (i = 0; i < n; i++)
+	{
+		k = 0;
+		if (i)
+		{
+			buf[k++] = ',';
+		}
+		ohms_ascii(ring_at(q, i)->ohms, buf + k);
+		k += 8;
+		buf[k] = '\0';
+		if (i)
+		{
+			strcpy(buf + k, "+");
+			append_u16(buf + k, ring_at(q, i)->stamp - ring_at(q, 0)->stamp);
+			k = strlen(buf);
+		}
+		for (j = 0; emit && j < k; j++)
+		{
+			emit(buf[j]);
+		}
+		len += k;
+	}
+	return len;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************link quality**************************************/
+/********************************************************************************/
+//signal strength (AT+CSQ) and registration (AT+CREG?) folded into a good/poor verdict.
+//Batch uploads wait while the link is poor, since at the edge of coverage a post takes
+//far longer and the modem spends it at high current.  The thresholds have a gap so the
+//verdict doesn't flap.  How long posts take in each state is kept to estimate what
+//waiting saved.
+#define LINK_POOR		8			//average CSQ below this (about -97dBm) is poor
+#define LINK_GOOD		12			//and it has to reach this (about -89dBm) to be good again
+#define LINK_POLL_S		120			//how stale the verdict can get before it is sampled again
+#define LINK_DEFER_MAX_S	1800	//readings are sent anyway once they have waited this long
+
+struct link
+{
+	uint8_t rssi_q2;		//average CSQ x 4
+	uint8_t registered;		//home or roaming
+	uint8_t good;
+	uint8_t samples;		//0 until the first sample
+	uint32_t at;			//when it was last sampled, seconds
+	uint32_t post_ms[2];	//average time a post takes on a poor [0] and good [1] link
+	uint32_t deferred_bytes;	//batch bytes that waited for a good link
+	uint16_t deferred;		//batches that waited
+	uint16_t poor_samples;
+};
+
+void link_init(struct link *l)
+{
+	memset(l, 0, sizeof *l);
+	l->good = 1;					//until told otherwise
+	l->post_ms[0] = 20000;			//guesses until posts have been timed
+	l->post_ms[1] = 5000;
+}
+
+//csq: rssi from +CSQ (99 unknown), creg: stat from +CREG (1 home, 5 roaming).  Returns the verdict
+uint8_t link_feed(struct link *l, uint8_t csq, uint8_t creg, uint32_t now)
+{
+	if (csq > 31)
+	{
+		csq = 0;
+	}
+	l->rssi_q2 = l->samples ? ((uint16_t)l->rssi_q2 + 4*csq) / 2 : 4*csq;
+	if (l->samples < 255)
+	{
+		l->samples++;
+	}
+	l->registered = creg == 1 || creg == 5;
+	l->at = now;
+	if (!l->registered || l->rssi_q2 < 4*LINK_POOR)
+	{
+		l->good = 0;
+	}
+	else if (l->rssi_q2 >= 4*LINK_GOOD)
+	{
+		l->good = 1;
+	}
+	if (!l->good)
+	{
+		l->poor_samples++;
+	}
+	return l->good;
+}
+
+uint8_t link_stale(struct link *l, uint32_t now)
+{
+	return !l->samples || now - l->at >= LINK_POLL_S;
+}
+
+//a post took ms with the link as it is now
+void link_post_time(struct link *l, uint32_t ms)
+{
+	l->post_ms[l->good] = (3*l->post_ms[l->good] + ms) / 4;
+}
+
+//a batch of bytes waited for a good link and is going now
+void link_deferred(struct link *l, uint16_t bytes)
+{
+	l->deferred++;
+	l->deferred_bytes += bytes;
+}
+
+//estimated charge saved by waiting, uAh, at ma10 (mA x 10) while posting: each
+//batch that waited went at the good link post time instead of the poor one
+uint32_t link_saved_uah(struct link *l, uint16_t ma10)
+{
+	uint32_t ms;
+
+	if (l->post_ms[0] <= l->post_ms[1])
+	{
+		return 0;
+	}
+	ms = (l->post_ms[0] - l->post_ms[1]) * l->deferred;
+	return ms / 360 * ma10 / 100;		//ms * mA / 3600
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************packed SMS****************************************/
+/********************************************************************************/
+//uplink by SMS while GPRS is down: as many queued posts as fit in one 160 character
+//text, as printable characters that are all single septets in the GSM 7-bit alphabet.
+//Numbers are varints in base 64: each character carries 5 bits, low bits first, and
+//values 32-63 mean more characters follow.  Signed numbers are zigzagged.
+//	'P' <seq> <UTC of the first record>		or
+//	'Q' <seq> <age of the first record in seconds when sent, clock not synced>
+//then per record:
+//	<endpoint (enum endpoint)> <time since the previous record, signed> <value change, signed>
+//the value is ohms for pole readings, 1/0 for a true/false ack, 0 for a fault, and each
+//record's change is from the previous record for the same endpoint (from 0 for the first).
+//tools/sms_decode.c turns these back into posts.
+#define SMS_LEN		160
+#define SMS_SEQ_MASK	0xFFF
+
+const char sms_alphabet[] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct sms_pack
+{
+	char text[SMS_LEN + 1];
+	uint8_t len;
+	uint8_t records;
+	uint16_t stamp;				//previous record's stamp
+	uint16_t value[EP_COUNT];	//previous value per endpoint
+};
+
+//varint v at text[at], 0 if it would run past SMS_LEN; returns the new length
+uint8_t sms_put(char *text, uint8_t at, uint32_t v)
+{
+	while (at < SMS_LEN)
+	{
+		if (v < 32)
+		{
+			text[at++] = pgm_read_byte(&sms_alphabet[v]);
+			return at;
+		}
+		text[at++] = pgm_read_byte(&sms_alphabet[32 | (v & 31)]);
+		v >>= 5;
+	}
+	return 0;
+}
+
+uint32_t sms_zigzag(int32_t v)
+{
+	return v < 0 ? ((uint32_t)(-v) << 1) - 1 : (uint32_t)v << 1;
+}
+
+//epoch_based: base is UTC of the first record (stamp), else its age when sent
+void sms_pack_start(struct sms_pack *p, uint16_t seq, uint8_t epoch_based, uint32_t base, uint16_t stamp)
+{
+	memset(p, 0, sizeof *p);
+	p->text[0] = epoch_based ? 'P' : 'Q';
+	p->len = sms_put(p->text, 1, seq & SMS_SEQ_MASK);
+	p->len = sms_put(p->text, p->len, base);
+	p->stamp = stamp;
+}
+
+//add a record; 0 if it doesn't fit (the text is left as it was)
+uint8_t sms_pack_add(struct sms_pack *p, uint8_t ep, uint16_t stamp, uint16_t value)
+{
+	uint8_t at = sms_put(p->text, p->len, ep);
+
+	if (at)
+	{
+		at = sms_put(p->text, at, sms_zigzag((int16_t)(stamp - p->stamp)));
+	}
+	if (at)
+	{
+		at = sms_put(p->text, at, sms_zigzag((int32_t)value - p->value[ep]));
+	}
+	if (!at)
+	{
+		p->text[p->len] = '\0';
+		return 0;
+	}
+	p->text[at] = '\0';
+	p->len = at;
+	p->stamp = stamp;
+	p->value[ep] = value;
+	p->records++;
+	return 1;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************report schedule***********************************/
+/********************************************************************************/
+//when a pole reports on its own: every every_s seconds, phase_s into each interval,
+//between from_h and to_h UTC (from_h == to_h for all day).  Slots count on UTC once the
+//clock has synced and on uptime before that.
+#define SCHED_MAX_S		43200
+
+struct schedule
+{
+	uint16_t every_s;		//0: off
+	uint16_t phase_s;
+	uint8_t from_h;
+	uint8_t to_h;
+};
+
+//0 if the schedule makes no sense (and EEPROM that was never written doesn't)
+uint8_t schedule_valid(const struct schedule *s)
+{
+	return s->every_s <= SCHED_MAX_S && s->phase_s < (s->every_s ? s->every_s : 1) && s->from_h < 24 && s->to_h < 24;
+}
+
+//"<every_s> [<phase_s> [<from_h>[-<to_h>]]]" as SMS P takes it after the pole; 0 if it
+//doesn't parse or makes no sense (s is left as it was)
+uint8_t schedule_parse(struct schedule *s, const char *arg)
+{
+	uint32_t every, phase = 0, from = 0, to;
+
+	if (!sms_number(&arg, &every) || every > SCHED_MAX_S)
+	{
+		return 0;
+	}
+	if (!sms_end(arg) && !sms_number(&arg, &phase))
+	{
+		return 0;
+	}
+	if (!sms_end(arg) && !sms_number(&arg, &from))
+	{
+		return 0;
+	}
+	to = from;
+	if (*arg == '-')
+	{
+		arg++;
+		if (!sms_number(&arg, &to))
+		{
+			return 0;
+		}
+	}
+	if (!sms_end(arg) || phase >= (every ? every : 1) || from > 23 || to > 23)
+	{
+		return 0;
+	}
+	s->every_s = every;
+	s->phase_s = phase;
+	s->from_h = from;
+	s->to_h = to;
+	return 1;
+}
+
+//number of the slot t is in; a report is due each time it changes
+uint32_t schedule_slot(const struct schedule *s, uint32_t t)
+{
+	return (t + s->every_s - s->phase_s) / s->every_s;
+}
+
+//1 if epoch is inside the active hours (always, before the clock has synced)
+uint8_t schedule_active(const struct schedule *s, uint32_t epoch)
+{
+	uint8_t h = epoch / 3600 % 24;
+
+	if (!epoch || s->from_h == s->to_h)
+	{
+		return 1;
+	}
+	if (s->from_h < s->to_h)
+	{
+		return h >= s->from_h && h < s->to_h;
+	}
+	return h >= s->from_h || h < s->to_h;
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+/******************************energy accounting*********************************/
+/********************************************************************************/
+//charge drawn, from the time spent in each power state and the current in it.  The MCU
+//is in one of active/idle (it never goes further than idle sleep) and the modem in one
+//of awake/asleep/GPRS; ADC and UART time draws on top.  The charge is also split by the operation it went on (a post, an
+//SMS in or out, ...): the innermost one running, or "other" (sampling, waiting).
+//Charge is kept per state rather than time, so the totals last (a uint32 of uAh) and
+//a new current only prices the time after it.  Time is priced a minute at a time (ms * uA
+//stays in 32 bits); what's under a ms or a uAh is carried to the next call.
+#define ADC_CONV_US		104			//13 ADC clocks at 125kHz
+#define OP_DEPTH		4
+#define PWR_UA_MAX		700000		//ENERGY_STEP_MS * uA/10 stays in 32 bits
+#define ENERGY_STEP_MS	60000UL
+
+enum pwr_state
+{
+	PWR_ACTIVE, PWR_IDLE,						//MCU
+	PWR_ADC, PWR_TX, PWR_RX,					//on top of the MCU
+	PWR_MODEM, PWR_MODEM_SLEEP, PWR_GPRS,		//modem
+	PWR_STATES
+};
+const char pwr_tag[] PROGMEM = "acidadtxrxmomsgp";	//two letters per state
+
+//typical currents, uA: ATmega32U4 at 16MHz/5V active and idle, the ADC, USART1 sending
+//and receiving, SIM800 registered idle, CSCLK sleep and GPRS transfer
+const uint32_t pwr_ua_typ[PWR_STATES] PROGMEM = {13000, 4500, 300, 1000, 500, 20000, 1200, 250000};
+
+enum pwr_op
+{
+	OP_OTHER, OP_BOOT, OP_POST, OP_SMS_IN, OP_SMS_OUT, OP_CAPTURE, OP_LINK, OP_CLOCK, OPS
+};
+const char op_tag[] PROGMEM = "otbopsiisocalicl";
+
+struct energy
+{
+	uint32_t ua[PWR_STATES];		//current in each state
+	uint32_t uah[PWR_STATES];		//charge drawn in each state
+	uint32_t rem[PWR_STATES];		//and what's under a uAh, in 1/360 nAh (ms * uA/10)
+	uint16_t us[PWR_STATES];		//time under a ms, not charged yet
+	uint32_t nah;					//charge not handed to an operation yet
+	uint32_t op_uah[OPS];			//charge per operation
+	uint16_t op_nah[OPS];			//and what's under a uAh
+	uint32_t op_n[OPS];				//times each ran
+	uint8_t op[OP_DEPTH];			//operations running, innermost last
+	uint8_t depth;
+};
+
+void energy_init(struct energy *e)
+{
+	uint8_t s;
+
+	memset(e, 0, sizeof *e);
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		e->ua[s] = pgm_read_dword(&pwr_ua_typ[s]);
+	}
+}
+
+//state for a two letter tag, PWR_STATES if there's none
+uint8_t pwr_find(const char *tag)
+{
+	uint8_t s;
+
+	for (s = 0; s < PWR_STATES; s++)
+	{
+		if (tag[0] == pgm_read_byte(&pwr_tag[2*s]) && tag[1] == pgm_read_byte(&pwr_tag[2*s + 1]))
+		{
+			break;
+		}
+	}
+	return s;
+}
+
+//"<tag> <uA>" as SMS Q takes it (e.g. "gp 350000"); 0 if it doesn't parse or the current
+//is over PWR_UA_MAX
+uint8_t pwr_parse(const char *arg, uint8_t *state, uint32_t *ua)
+{
+	arg += strspn(arg, " ");
+	*state = pwr_find(arg);
+	if (*state == PWR_STATES)
+	{
+		return 0;
+	}
+	arg += 2;
+	return sms_number(&arg, ua) && sms_end(arg) && *ua <= PWR_UA_MAX;
+}
+
+void energy_add(struct energy *e, uint8_t state, uint32_t us)
+{
+	uint32_t ms = us / 1000;
+	uint32_t step;
+	uint32_t was;
+	uint32_t x;
+
+	us = us % 1000 + e->us[state];
+	ms += us / 1000;
+	e->us[state] = us % 1000;
+	while (ms)
+	{
+		step = ms < ENERGY_STEP_MS ? ms : ENERGY_STEP_MS;
+		was = e->rem[state];
+		x = was + step * (e->ua[state] / 10);
+		e->nah += x / 360 - was / 360;
+		e->uah[state] += x / 360000;
+		e->rem[state] = x % 360000;
+		ms -= step;
+	}
+}
+
+//hand the charge drawn since the last call to the operation running
+void energy_charge(struct energy *e)
+{
+	uint8_t op = e->depth ? e->op[e->depth - 1] : OP_OTHER;
+	uint32_t nah = e->nah + e->op_nah[op];
+
+	e->nah = 0;
+	e->op_uah[op] += nah / 1000;
+	e->op_nah[op] = nah % 1000;
+}
+
+//an operation starts (counted once per call, so a resumed one can skip it)
+void energy_begin(struct energy *e, uint8_t op, uint8_t count)
+{
+	energy_charge(e);
+	if (e->depth < OP_DEPTH)
+	{
+		e->op[e->depth++] = op;
+	}
+	e->op_n[op] += count;
+}
+
+void energy_end(struct energy *e, uint8_t op)
+{
+	uint8_t i;
+
+	energy_charge(e);
+	for (i = e->depth; i--; )
+	{
+		if (e->op[i] == op)
+		{
+			memmove(&e->op[i], &e->op[i + 1], e->depth - i - 1);
+			e->depth--;
+			break;
+		}
+	}
+}
+
+//charge drawn in a state so far, uAh
+uint32_t energy_uah(struct energy *e, uint8_t state)
+{
+	return e->uah[state];
+}
+
+/********************************************************************************/
+/********************************************************************************/
+
+#endif
@@ -0,0 +1,834 @@
+/*
+ * fleet_load.c
+ *
+ * Host tool: load generator for the server side.  Runs many simulated sensors in
+ * one process, each with the firmware's own queue, payload formatting and retry
+ * policy (sensor_core.h), an emulated SIM800 and an emulated pole resistance on
+ * the ADC, all posting to a local HTTP endpoint.  Reports throughput and latency
+ * percentiles at the end.
+ *
+ *   gcc -O2 -I. -o fleet_load tools/fleet_load.c
+ *   ./fleet_load -n 200 -d 60 -p 3000
+ *
+ * Options (rates are per device, 0 turns a source off):
+ *   -n devices        simulated sensors (default 50)
+ *   -d seconds        run time (default 30)
+ *   -H host -p port   server (default 127.0.0.1:3000)
+ *   -t seconds        pole reading interval, both poles per reading (default 10)
+ *   -a seconds        mean time between control SMS acks (default 60)
+ *   -f seconds        mean time between contact faults (default 300)
+ *   -w seconds        mean time between burst captures (default 0)
+ *   -m ms             modem reply time per AT command (default 30)
+ *   -e percent        AT steps failing at the modem (default 0)
+ *   -b baud           modem UART rate (default 115200)
+ *   -c state=uA,...   currents for the energy model, e.g. gp=350000,mo=25000
+ *                     (states as SMS Q: ac id ad tx rx mo ms gp)
+ *
+ * Each post is what the firmware sends: the url setup commands, HTTPDATA with the
+ * payload, then HTTPACTION.  Pole readings wait in a ring per pole and go up as one
+ * batch post per pole whenever the last batch is done, as on the device.  The AT part is a timer (-m per command plus UART time);
+ * HTTPACTION is a real HTTP/1.1 POST.  One post per device is in flight at a time.
+ *
+ * Each device also runs the firmware's energy accounting (sensor_core.h): the modem
+ * is in GPRS during HTTPACTION, awake through a post and MODEM_IDLE_MS after it and
+ * asleep otherwise; the MCU idles between bursts of work; ADC and UART time come
+ * from the readings and the AT traffic.  The report gives mAh per hour per device,
+ * split by power state, and the charge per post.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sensor_core.h"
+
+#define URL_SETUP_STEPS	7			//url_setup[] in the firmware
+#define MODEM_IDLE_MS	5000		//modem power in the firmware
+#define AT_CMD_BYTES	24			//an average AT command and its CR
+#define AT_REPLY_BYTES	8			//and its reply
+#define AT_CPU_US		1000		//MCU work per AT command
+#define READ_CPU_US		200			//MCU work per pole reading
+
+enum dev_state
+{
+	DEV_IDLE,		//nothing in flight
+	DEV_AT,			//emulated setup and HTTPDATA exchange
+	DEV_CONNECT,	//HTTPACTION: TCP connect
+	DEV_SEND,		//HTTPACTION: request going out
+	DEV_RECV,		//HTTPACTION: reading the response
+	DEV_BACKOFF		//waiting to retry
+};
+
+struct device
+{
+	int id;
+	struct outq q;
+	uint64_t queued_us[256];	//when each queue seq went in, for delivery latency
+	uint8_t state;
+	uint8_t tries;
+	uint8_t at_ok;				//AT part already done for this post (a failed action keeps the payload)
+	struct out_msg msg;
+	uint64_t due_us;			//timer for DEV_AT and DEV_BACKOFF, deadline for the HTTP states
+	uint64_t sent_us;			//HTTPACTION start
+	int fd;
+	char req[1024];
+	int req_len;
+	int req_off;
+	char resp[64];
+	int resp_len;
+	struct sample_ring ring[2];	//readings waiting for a batch post
+	uint8_t code[2];			//emulated ADC reading per pole
+	uint8_t fault;				//pole with a bad contact right now, 0 if none
+	uint64_t next_read_us;
+	uint64_t next_ack_us;
+	uint64_t next_fault_us;
+	uint64_t next_wave_us;
+	uint8_t wave[256];			//last capture (the firmware's capture_buf)
+	uint8_t wave_pole;
+	struct energy e;
+	uint64_t pwr_us;			//accounted up to here
+	uint64_t awake_until;		//modem sleeps from here if nothing else comes
+	uint32_t busy_us;			//MCU work since pwr_us
+};
+
+struct lat
+{
+	uint32_t *us;
+	size_t n;
+	size_t cap;
+};
+
+struct totals
+{
+	uint64_t queued[PRIO_CLASSES];
+	uint64_t ok[PRIO_CLASSES];
+	uint64_t retry[PRIO_CLASSES];
+	uint64_t refused[PRIO_CLASSES];		//4xx
+	uint64_t failed[PRIO_CLASSES];		//out of tries
+	uint64_t wire_bytes;
+	uint64_t readings;					//pole readings taken
+	uint64_t delivered;					//pole readings in batches that went up
+	struct lat http;					//HTTPACTION to the end of the response
+	struct lat deliver;					//queued to 2xx
+};
+
+static const char *prio_name[PRIO_CLASSES] = {"fault", "ack", "telemetry"};
+
+static struct sockaddr_in server;
+static char host_hdr[64];
+static int n_dev = 50;
+static double run_s = 30;
+static double read_s = 10, ack_s = 60, fault_s = 300, wave_s = 0;
+static unsigned modem_ms = 30, fail_pct = 0;
+static unsigned baud = 115200;
+static uint32_t pwr_ua[PWR_STATES];
+static uint64_t start_us;
+static struct totals tot;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//0.5-1.5x the mean, 0 mean means never
+static uint64_t next_in(double mean_s, uint64_t now)
+{
+	if (mean_s <= 0)
+	{
+		return UINT64_MAX;
+	}
+	return now + (uint64_t)(mean_s * 1e6 * (0.5 + rand() / (RAND_MAX + 1.0)));
+}
+
+static void lat_add(struct lat *l, uint64_t us)
+{
+	if (l->n == l->cap)
+	{
+		l->cap = l->cap ? l->cap * 2 : 4096;
+		l->us = realloc(l->us, l->cap * sizeof *l->us);
+		if (!l->us)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	l->us[l->n++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void lat_report(const char *name, struct lat *l)
+{
+	static const double pct[] = {50, 90, 99, 99.9};
+	size_t i, k;
+
+	printf("%-10s", name);
+	if (!l->n)
+	{
+		printf(" no samples\n");
+		return;
+	}
+	qsort(l->us, l->n, sizeof *l->us, cmp_u32);
+	for (i = 0; i < sizeof pct / sizeof pct[0]; i++)
+	{
+		k = (size_t)(pct[i] / 100 * l->n);
+		if (k >= l->n)
+		{
+			k = l->n - 1;
+		}
+		printf("  p%-4g %8.1fms", pct[i], l->us[k] / 1000.0);
+	}
+	printf("  max %8.1fms\n", l->us[l->n - 1] / 1000.0);
+}
+
+/******************************emulated sensor***********************************/
+
+//time since the last call into the device's energy accounting (energy_sync() in the firmware)
+static void dev_energy(struct device *d, uint64_t now)
+{
+	uint32_t us = now - d->pwr_us;
+	uint8_t modem;
+
+	if (d->state == DEV_CONNECT || d->state == DEV_SEND || d->state == DEV_RECV)
+	{
+		modem = PWR_GPRS;
+	}
+	else
+	{
+		modem = d->state != DEV_IDLE || now < d->awake_until ? PWR_MODEM : PWR_MODEM_SLEEP;
+	}
+	if (d->busy_us > us)
+	{
+		d->busy_us = us;
+	}
+	energy_add(&d->e, modem, us);
+	energy_add(&d->e, PWR_ACTIVE, d->busy_us);
+	energy_add(&d->e, PWR_IDLE, us - d->busy_us);
+	energy_charge(&d->e);
+	d->busy_us = 0;
+	d->pwr_us = now;
+}
+
+//AT exchange of cmds commands and extra payload bytes over the UART
+static void dev_uart(struct device *d, unsigned cmds, unsigned extra)
+{
+	energy_add(&d->e, PWR_TX, (cmds * AT_CMD_BYTES + extra) * 10000000ULL / baud);
+	energy_add(&d->e, PWR_RX, cmds * AT_REPLY_BYTES * 10000000ULL / baud);
+	d->busy_us += cmds * AT_CPU_US;
+}
+
+//device clock stamp: uptime seconds, as clock_stamp() in the firmware
+static uint16_t dev_stamp(uint64_t now)
+{
+	return (uint16_t)((now - start_us) / 1000000);
+}
+
+static void dev_push(struct device *d, uint8_t prio, uint8_t ep, const char *body, uint8_t len, uint64_t now)
+{
+	uint16_t merges = d->q.stats[prio].merge;
+	struct out_msg *m = outq_push(&d->q, prio, ep, body, len, dev_stamp(now));
+
+	tot.queued[prio]++;
+	if (m && d->q.stats[prio].merge == merges)
+	{
+		d->queued_us[m->seq] = now;
+	}
+}
+
+//pole resistance wanders around the 1k nominal; a bad contact reads open
+static uint8_t dev_sample(struct device *d, uint8_t pole)
+{
+	int c = d->code[pole - 1] + rand() % 5 - 2;
+
+	if (c < 96)
+	{
+		c = 96;
+	}
+	if (c > 160)
+	{
+		c = 160;
+	}
+	d->code[pole - 1] = c;
+	return d->fault == pole ? 255 : c;
+}
+
+//the ring a batch post drains, 0 for any other post (up_ring() in the firmware)
+static struct sample_ring *dev_ring(struct device *d, struct out_msg *m)
+{
+	if (m->len != 1 || m->body[0] != 'B')
+	{
+		return 0;
+	}
+	return &d->ring[m->ep == EP_DATA2];
+}
+
+//both poles into their rings, and a batch post queued for each unless one is on the way
+//(pole acquisition and sample_poll() in the firmware)
+static void dev_read_poles(struct device *d, uint64_t now)
+{
+	uint8_t pole, ep, i;
+	uint8_t pending;
+
+	for (pole = 1; pole <= 2; pole++)
+	{
+		ep = pole == 1 ? EP_DATA1 : EP_DATA2;
+		ring_push(&d->ring[pole - 1], adc_to_ohms(pole == 1 ? CAL_CH1 : CAL_CH2, dev_sample(d, pole)), dev_stamp(now));
+		energy_add(&d->e, PWR_ADC, ADC_CONV_US);
+		d->busy_us += READ_CPU_US;
+		tot.readings++;
+		pending = d->state != DEV_IDLE && d->msg.ep == ep && dev_ring(d, &d->msg);
+		for (i = 0; i < OUTQ_DEPTH && !pending; i++)
+		{
+			pending = d->q.slot[i].len && d->q.slot[i].ep == ep && dev_ring(d, &d->q.slot[i]);
+		}
+		if (!pending)
+		{
+			dev_push(d, PRIO_TELEMETRY, ep, "B", 1, now);
+		}
+	}
+}
+
+static void dev_capture(struct device *d, uint64_t now)
+{
+	uint16_t i;
+	uint8_t base;
+
+	if (outq_find(&d->q, PRIO_TELEMETRY, EP_WAVE1) || outq_find(&d->q, PRIO_TELEMETRY, EP_WAVE2) ||
+		(d->state != DEV_IDLE && (d->msg.ep == EP_WAVE1 || d->msg.ep == EP_WAVE2)))
+	{
+		return;				//capture_busy()
+	}
+	d->wave_pole = 1 + rand() % 2;
+	base = d->code[d->wave_pole - 1];
+	for (i = 0; i < sizeof d->wave; i++)
+	{
+		d->wave[i] = base + ((i / 8) & 1 ? 6 : -6) + rand() % 3 - 1;		//400Hz ripple on the 2kHz capture
+	}
+	energy_add(&d->e, PWR_ADC, sizeof d->wave * ADC_CONV_US);
+	d->busy_us += sizeof d->wave * 500;				//the MCU waits out the 2kHz capture
+	dev_push(d, PRIO_TELEMETRY, d->wave_pole == 1 ? EP_WAVE1 : EP_WAVE2, "W", 1, now);
+}
+
+static void dev_sources(struct device *d, uint64_t now)
+{
+	static const char *acks[] = {"true", "false"};
+	const char *a;
+
+	if (now >= d->next_read_us)
+	{
+		dev_read_poles(d, now);
+		d->next_read_us += (uint64_t)(read_s * 1e6);
+	}
+	if (now >= d->next_ack_us)
+	{
+		a = acks[rand() % 2];
+		dev_push(d, PRIO_ACK, rand() % 2 ? EP_STAT1 : EP_STAT2, a, strlen(a), now);
+		d->next_ack_us = next_in(ack_s, now);
+	}
+	if (now >= d->next_fault_us)
+	{
+		d->fault = d->fault ? 0 : 1 + rand() % 2;
+		if (d->fault)
+		{
+			dev_push(d, PRIO_FAULT, d->fault == 1 ? EP_BAD1 : EP_BAD2, "0", 1, now);
+		}
+		d->next_fault_us = next_in(d->fault ? 5 : fault_s, now);		//contacts come back after a few seconds
+	}
+	if (now >= d->next_wave_us)
+	{
+		dev_capture(d, now);
+		d->next_wave_us = next_in(wave_s, now);
+	}
+}
+
+/******************************emulated uploader*********************************/
+
+static char *payload_out;
+
+static void payload_put(uint8_t c)
+{
+	*payload_out++ = c;
+}
+
+static int dev_payload(struct device *d, char *dst)
+{
+	struct sample_ring *ring = dev_ring(d, &d->msg);
+
+	if (ring)
+	{
+		payload_out = dst;
+		return batch_encode(ring, ring->pinned, payload_put);
+	}
+	if (d->msg.ep == EP_WAVE1 || d->msg.ep == EP_WAVE2)
+	{
+		payload_out = dst;
+		return wave_encode(d->wave, sizeof d->wave, d->wave_pole, 2000, payload_put);
+	}
+	memcpy(dst, d->msg.body, d->msg.len);
+	return d->msg.len;
+}
+
+//the post in flight is finished with, sent or not
+static void dev_done(struct device *d, uint64_t now)
+{
+	struct sample_ring *ring = dev_ring(d, &d->msg);
+
+	if (ring)
+	{
+		ring_release(ring);
+	}
+	dev_energy(d, now);
+	energy_end(&d->e, OP_POST);
+	d->awake_until = now + MODEM_IDLE_MS * 1000ULL;
+	d->state = DEV_IDLE;
+}
+
+static void dev_close(struct device *d)
+{
+	if (d->fd >= 0)
+	{
+		close(d->fd);
+		d->fd = -1;
+	}
+}
+
+//a step failed: back off and retry it, or drop the post
+static void dev_fail(struct device *d, uint64_t now)
+{
+	dev_close(d);
+	if (++d->tries >= HTTP_TRIES)
+	{
+		tot.failed[d->msg.prio]++;
+		dev_done(d, now);
+		return;
+	}
+	tot.retry[d->msg.prio]++;
+	d->state = DEV_BACKOFF;
+	d->due_us = now + http_backoff_ms(d->tries) * 1000ULL;
+}
+
+//AT part of a post: url setup, HTTPDATA, payload over the UART
+static void dev_start_at(struct device *d, uint64_t now)
+{
+	char body[600];
+	unsigned cmds = d->at_ok ? 1 : URL_SETUP_STEPS + 2;
+	unsigned len = d->at_ok ? 0 : dev_payload(d, body);
+
+	d->state = DEV_AT;
+	d->due_us = now + cmds * modem_ms * 1000ULL + len * 10000000ULL / baud;
+	dev_uart(d, cmds, len);
+}
+
+static void dev_start_http(struct device *d, uint64_t now)
+{
+	char body[600];
+	char path[64];
+	int len = dev_payload(d, body);
+	int one = 1;
+
+	strcpy(path, pgm_read_ptr(&endpoint_path[d->msg.ep]));
+	strcat(path, "?t=");
+	append_u32(path, (uint32_t)time(NULL) - (dev_stamp(now) - d->msg.stamp));
+	d->req_len = snprintf(d->req, sizeof d->req,
+		"POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: SIMCOM_MODULE\r\nContent-Type: text/plain\r\n"
+		"Content-Length: %d\r\nConnection: close\r\n\r\n", path, host_hdr, len);
+	memcpy(d->req + d->req_len, body, len);
+	d->req_len += len;
+	d->req_off = 0;
+	d->resp_len = 0;
+	tot.wire_bytes += d->req_len;
+
+	d->sent_us = now;
+	d->due_us = now + HTTP_ACTION_MS * 1000ULL;
+	d->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (d->fd < 0)
+	{
+		perror("socket");
+		exit(1);
+	}
+	fcntl(d->fd, F_SETFL, O_NONBLOCK);
+	setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	if (connect(d->fd, (struct sockaddr *)&server, sizeof server) && errno != EINPROGRESS)
+	{
+		dev_fail(d, now);
+		return;
+	}
+	d->state = DEV_CONNECT;
+}
+
+static void dev_result(struct device *d, uint16_t status, uint64_t now)
+{
+	dev_close(d);
+	lat_add(&tot.http, now - d->sent_us);
+	switch (http_verdict(status))
+	{
+		case HTTP_DONE:
+			tot.ok[d->msg.prio]++;
+			lat_add(&tot.deliver, now - d->queued_us[d->msg.seq]);
+			if (dev_ring(d, &d->msg))
+			{
+				tot.delivered += dev_ring(d, &d->msg)->pinned;
+			}
+			dev_done(d, now);
+		break;
+		case HTTP_GIVE_UP:
+			tot.refused[d->msg.prio]++;
+			dev_done(d, now);
+		break;
+		default:
+			dev_fail(d, now);
+		break;
+	}
+}
+
+//advance one device; revents are for its socket
+static void dev_poll(struct device *d, short revents, uint64_t now)
+{
+	struct out_msg *head;
+	int err;
+	socklen_t el = sizeof err;
+	ssize_t r;
+	char *sp;
+	char buf[512];
+
+	dev_energy(d, now);
+	switch (d->state)
+	{
+		case DEV_IDLE:
+			if (!outq_pop(&d->q, &d->msg))
+			{
+				break;
+			}
+			energy_begin(&d->e, OP_POST, 1);
+			if (dev_ring(d, &d->msg))
+			{
+				dev_ring(d, &d->msg)->pinned = dev_ring(d, &d->msg)->n;
+			}
+			d->tries = 0;
+			d->at_ok = 0;
+			dev_start_at(d, now);
+		break;
+		case DEV_AT:
+			if (now < d->due_us)
+			{
+				break;
+			}
+			if (rand() % 100 < (int)fail_pct)
+			{
+				dev_fail(d, now);
+				break;
+			}
+			d->at_ok = 1;
+			dev_uart(d, 1, 0);					//HTTPACTION
+			dev_start_http(d, now);
+		break;
+		case DEV_CONNECT:
+		case DEV_SEND:
+		case DEV_RECV:
+			if (now >= d->due_us)
+			{
+				dev_result(d, 0, now);		//no +HTTPACTION in time
+				break;
+			}
+			if (!revents)
+			{
+				break;
+			}
+			if (d->state == DEV_CONNECT)
+			{
+				getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &el);
+				if (err)
+				{
+					dev_result(d, 601, now);	//SIM800: network error
+					break;
+				}
+				d->state = DEV_SEND;
+			}
+			if (d->state == DEV_SEND)
+			{
+				r = write(d->fd, d->req + d->req_off, d->req_len - d->req_off);
+				if (r < 0 && errno != EAGAIN)
+				{
+					dev_result(d, 601, now);
+					break;
+				}
+				if (r > 0 && (d->req_off += r) == d->req_len)
+				{
+					d->state = DEV_RECV;
+				}
+				break;
+			}
+			r = read(d->fd, buf, sizeof buf);
+			if (r < 0 && errno == EAGAIN)
+			{
+				break;
+			}
+			if (r > 0)
+			{
+				if (r > (int)sizeof d->resp - 1 - d->resp_len)
+				{
+					r = sizeof d->resp - 1 - d->resp_len;		//only the status line matters
+				}
+				memcpy(d->resp + d->resp_len, buf, r);
+				d->resp_len += r;
+				d->resp[d->resp_len] = '\0';
+				break;					//the server closes when the response is all there
+			}
+			sp = strchr(d->resp, ' ');
+			dev_result(d, (!strncmp(d->resp, "HTTP/", 5) && sp) ? atoi(sp + 1) : 604, now);
+		break;
+		case DEV_BACKOFF:
+			head = outq_head(&d->q);
+			if (head && head->prio < d->msg.prio)		//something more urgent came in; it goes first
+			{
+				if (dev_ring(d, &d->msg))
+				{
+					dev_ring(d, &d->msg)->pinned = 0;
+				}
+				if (d->msg.prio == PRIO_TELEMETRY || !outq_find(&d->q, d->msg.prio, d->msg.ep))
+				{
+					head = outq_push(&d->q, d->msg.prio, d->msg.ep, d->msg.body, d->msg.len, d->msg.stamp);
+					if (head)
+					{
+						d->queued_us[head->seq] = d->queued_us[d->msg.seq];
+					}
+				}
+				energy_end(&d->e, OP_POST);
+				d->state = DEV_IDLE;
+			}
+			else if (now >= d->due_us)
+			{
+				dev_start_at(d, now);
+			}
+		break;
+	}
+}
+
+static short dev_events(struct device *d)
+{
+	switch (d->state)
+	{
+		case DEV_CONNECT:
+		case DEV_SEND:
+			return POLLOUT;
+		case DEV_RECV:
+			return POLLIN;
+	}
+	return 0;
+}
+
+/********************************************************************************/
+
+//"gp=350000,mo=25000": currents for the energy model, 0 on a bad one
+static int set_currents(char *arg)
+{
+	char *tok;
+	uint32_t ua;
+	uint8_t s;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+	{
+		if (strlen(tok) < 3 || tok[2] != '=')
+		{
+			return 0;
+		}
+		tok[2] = ' ';						//as SMS Q takes it
+		if (!pwr_parse(tok, &s, &ua))
+		{
+			return 0;
+		}
+		pwr_ua[s] = ua;
+	}
+	return 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n devices] [-d seconds] [-H host] [-p port] [-t s] [-a s] [-f s] [-w s] [-m ms] [-e pct] [-b baud] [-c state=uA,...]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct device *dev;
+	struct pollfd *pfd;
+	int *pdev;
+	const char *host = "127.0.0.1";
+	int port = 3000;
+	int opt, i, n, timeout;
+	uint64_t now, end, next_progress;
+	uint64_t sum_q = 0, sum_ok = 0, merged = 0, dropped = 0, ring_drops = 0;
+	unsigned max_depth = 0;
+	double secs, hours, mah, state_mah[PWR_STATES] = {0}, post_uah = 0, other_uah = 0;
+	uint64_t posts = 0;
+	static const char *state_name[PWR_STATES] = {"MCU active", "MCU idle", "ADC", "UART tx",
+		"UART rx", "modem awake", "modem asleep", "GPRS"};
+
+	for (i = 0; i < PWR_STATES; i++)
+	{
+		pwr_ua[i] = pgm_read_dword(&pwr_ua_typ[i]);
+	}
+	while ((opt = getopt(argc, argv, "n:d:H:p:t:a:f:w:m:e:b:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': n_dev = atoi(optarg); break;
+			case 'd': run_s = atof(optarg); break;
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 't': read_s = atof(optarg); break;
+			case 'a': ack_s = atof(optarg); break;
+			case 'f': fault_s = atof(optarg); break;
+			case 'w': wave_s = atof(optarg); break;
+			case 'm': modem_ms = atoi(optarg); break;
+			case 'e': fail_pct = atoi(optarg); break;
+			case 'b': baud = atoi(optarg); break;
+			case 'c': if (!set_currents(optarg)) usage(argv[0]); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (n_dev < 1 || run_s <= 0 || !baud || optind != argc)
+	{
+		usage(argv[0]);
+	}
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &server.sin_addr) != 1)
+	{
+		fprintf(stderr, "%s: bad address %s\n", argv[0], host);
+		return 2;
+	}
+	snprintf(host_hdr, sizeof host_hdr, "%s:%d", host, port);
+
+	dev = calloc(n_dev, sizeof *dev);
+	pfd = calloc(n_dev, sizeof *pfd);
+	pdev = calloc(n_dev, sizeof *pdev);
+	if (!dev || !pfd || !pdev)
+	{
+		perror("calloc");
+		return 1;
+	}
+	srand(1);
+	start_us = now_us();
+	for (i = 0; i < n_dev; i++)
+	{
+		dev[i].id = i;
+		dev[i].fd = -1;
+		dev[i].code[0] = dev[i].code[1] = 128;
+		energy_init(&dev[i].e);
+		memcpy(dev[i].e.ua, pwr_ua, sizeof pwr_ua);
+		dev[i].pwr_us = start_us;
+		dev[i].next_read_us = read_s > 0 ? start_us + (uint64_t)(read_s * 1e6 * i / n_dev) : UINT64_MAX;	//spread the phases
+		dev[i].next_ack_us = next_in(ack_s, start_us);
+		dev[i].next_fault_us = next_in(fault_s, start_us);
+		dev[i].next_wave_us = next_in(wave_s, start_us);
+	}
+	end = start_us + (uint64_t)(run_s * 1e6);
+	next_progress = start_us + 5000000;
+
+	for (now = start_us; now < end; now = now_us())
+	{
+		n = 0;
+		timeout = 5;
+		for (i = 0; i < n_dev; i++)
+		{
+			dev_sources(&dev[i], now);
+			dev_poll(&dev[i], 0, now);
+			if (dev_events(&dev[i]))
+			{
+				pfd[n].fd = dev[i].fd;
+				pfd[n].events = dev_events(&dev[i]);
+				pdev[n++] = i;
+			}
+		}
+		if (poll(pfd, n, timeout) > 0)
+		{
+			now = now_us();
+			for (i = 0; i < n; i++)
+			{
+				if (pfd[i].revents)
+				{
+					dev_poll(&dev[pdev[i]], pfd[i].revents, now);
+				}
+			}
+		}
+		if (now >= next_progress)
+		{
+			fprintf(stderr, "%5.0fs  %zu posts ok\n", (now - start_us) / 1e6, tot.deliver.n);
+			next_progress += 5000000;
+		}
+	}
+	secs = (now_us() - start_us) / 1e6;
+
+	now = now_us();
+	for (i = 0; i < n_dev; i++)
+	{
+		dev_energy(&dev[i], now);
+		for (opt = 0; opt < PWR_STATES; opt++)
+		{
+			state_mah[opt] += (dev[i].e.uah[opt] + dev[i].e.rem[opt] / 360000.0) / 1000;
+		}
+		post_uah += dev[i].e.op_uah[OP_POST] + dev[i].e.op_nah[OP_POST] / 1000.0;
+		other_uah += dev[i].e.op_uah[OP_OTHER] + dev[i].e.op_nah[OP_OTHER] / 1000.0;
+		posts += dev[i].e.op_n[OP_POST];
+		dev_close(&dev[i]);
+		for (opt = 0; opt < PRIO_CLASSES; opt++)
+		{
+			merged += dev[i].q.stats[opt].merge;
+			dropped += dev[i].q.stats[opt].drop;
+		}
+		ring_drops += dev[i].ring[0].drops + dev[i].ring[1].drops;
+		if (dev[i].q.max > max_depth)
+		{
+			max_depth = dev[i].q.max;
+		}
+	}
+	printf("%d devices, %.1fs, server %s\n", n_dev, secs, host_hdr);
+	printf("%-10s %9s %9s %9s %9s %9s\n", "class", "queued", "ok", "retries", "refused", "failed");
+	for (i = 0; i < PRIO_CLASSES; i++)
+	{
+		printf("%-10s %9llu %9llu %9llu %9llu %9llu\n", prio_name[i], (unsigned long long)tot.queued[i],
+			(unsigned long long)tot.ok[i], (unsigned long long)tot.retry[i],
+			(unsigned long long)tot.refused[i], (unsigned long long)tot.failed[i]);
+		sum_q += tot.queued[i];
+		sum_ok += tot.ok[i];
+	}
+	printf("queue: %llu merged, %llu dropped, deepest %u of %d\n", (unsigned long long)merged,
+		(unsigned long long)dropped, max_depth, OUTQ_DEPTH);
+	printf("throughput: %.1f posts/s, %.1f kB/s on the wire (%llu of %llu queued delivered)\n",
+		sum_ok / secs, tot.wire_bytes / secs / 1000, (unsigned long long)sum_ok, (unsigned long long)sum_q);
+	printf("readings: %llu taken, %llu delivered, %llu dropped at a full ring\n", (unsigned long long)tot.readings,
+		(unsigned long long)tot.delivered, (unsigned long long)ring_drops);
+	lat_report("http", &tot.http);
+	lat_report("delivery", &tot.deliver);
+	hours = secs / 3600 * n_dev;
+	for (mah = 0, i = 0; i < PWR_STATES; i++)
+	{
+		mah += state_mah[i];
+	}
+	printf("energy: %.2f mAh/h per device, %.1f uAh per post (%llu posts), %.2f mAh/h between posts\n",
+		mah / hours, posts ? post_uah / posts : 0, (unsigned long long)posts, other_uah / 1000 / hours);
+	for (i = 0; i < PWR_STATES; i++)
+	{
+		printf("  %-13s %8luuA %9.3f mAh/h %5.1f%%\n", state_name[i], (unsigned long)pwr_ua[i], state_mah[i] / hours,
+			mah ? 100 * state_mah[i] / mah : 0);
+	}
+	return 0;
+}
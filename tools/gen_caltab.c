@@ -0,0 +1,185 @@
+/*
+ * gen_caltab.c
+ *
+ * Host tool: builds cal_table.h (ADC code -> ohms lookup tables in flash)
+ * from per-channel divider values and calibration measurements.
+ *
+ *   gcc -O2 -o gen_caltab tools/gen_caltab.c -lm
+ *   ./gen_caltab tools/cal_nominal.txt > cal_table.h
+ *
+ * Input lines (# starts a comment):
+ *   rref <ch> <ohms>               known divider resistor for channel 1 or 2
+ *   meas <ch> <ohms> <adc_code>    reference resistor fitted in place of the pole
+ *                                  and the averaged 8-bit code read_ADC() gave
+ *
+ * Divider model: code = 256*Rx/(Rx+Rref).  The measurements fit a gain and
+ * offset on top of that (code_meas = gain*code_ideal + offset); with no
+ * measurements the channel is nominal (gain 1, offset 0).  The fit only shapes
+ * the tables; it goes in the header comment for the record.  The last point
+ * (code 256) is OHMS_OPEN whatever the fit, so a contact reading full scale is
+ * always open.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CHANNELS	2
+#define MAX_MEAS	64
+#define STEP_SHIFT	2							//one table point every 4 codes
+#define POINTS		((256>>STEP_SHIFT)+1)		//last point is code 256 (open)
+#define OHMS_OPEN	0xFFFF
+
+struct channel
+{
+	double rref;
+	double gain;
+	double offset;
+	int n;
+	double ohms[MAX_MEAS];
+	double code[MAX_MEAS];
+};
+
+static struct channel ch[CHANNELS];
+
+static double ideal_code(double rx, double rref)
+{
+	return 256.0*rx/(rx+rref);
+}
+
+//least squares fit of measured code against the ideal divider code
+static void fit(struct channel *c)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, den;
+	int i;
+
+	c->gain = 1.0;
+	c->offset = 0.0;
+	if (c->n == 0)
+		return;
+	for (i = 0; i < c->n; i++)
+	{
+		x = ideal_code(c->ohms[i], c->rref);
+		y = c->code[i];
+		sx += x;
+		sy += y;
+		sxx += x*x;
+		sxy += x*y;
+	}
+	den = c->n*sxx - sx*sx;
+	if (c->n < 2 || fabs(den) < 1e-9)
+	{
+		c->offset = (sy - sx)/c->n;		//single point: offset only
+		return;
+	}
+	c->gain = (c->n*sxy - sx*sy)/den;
+	c->offset = (sy - c->gain*sx)/c->n;
+}
+
+static unsigned table_point(const struct channel *c, int code)
+{
+	double i = (code - c->offset)/c->gain;
+	double r;
+
+	if (code >= 256)
+		return OHMS_OPEN;				//even if a gain over 1 puts full scale inside the range
+	if (i <= 0.0)
+		return 0;
+	if (i >= 256.0)
+		return OHMS_OPEN;
+	r = c->rref*i/(256.0 - i);
+	if (r >= OHMS_OPEN)
+		return OHMS_OPEN;
+	return (unsigned)(r + 0.5);
+}
+
+static int load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	char kw[16];
+	int n, lineno = 0;
+	double a, b;
+
+	if (!f)
+	{
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof line, f))
+	{
+		lineno++;
+		if (line[0] == '#' || sscanf(line, "%15s", kw) != 1)
+			continue;
+		if (strcmp(kw, "rref") == 0 && sscanf(line, "%*s %d %lf", &n, &a) == 2 && n >= 1 && n <= CHANNELS)
+		{
+			ch[n-1].rref = a;
+		}
+		else if (strcmp(kw, "meas") == 0 && sscanf(line, "%*s %d %lf %lf", &n, &a, &b) == 3 && n >= 1 && n <= CHANNELS)
+		{
+			if (ch[n-1].n < MAX_MEAS)
+			{
+				ch[n-1].ohms[ch[n-1].n] = a;
+				ch[n-1].code[ch[n-1].n] = b;
+				ch[n-1].n++;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <calibration file>\n", argv[0]);
+		return 2;
+	}
+	if (load(argv[1]))
+		return 1;
+	for (c = 0; c < CHANNELS; c++)
+	{
+		if (ch[c].rref <= 0)
+		{
+			fprintf(stderr, "channel %d: missing rref\n", c+1);
+			return 1;
+		}
+		fit(&ch[c]);
+	}
+
+	printf("/*\n * cal_table.h\n *\n * Generated by tools/gen_caltab from %s -- do not edit.\n", argv[1]);
+	printf(" * ADC code -> ohms, one point every %d codes, OHMS_OPEN past the divider range.\n", 1<<STEP_SHIFT);
+	for (c = 0; c < CHANNELS; c++)
+	{
+		printf(" * Channel %d: gain %.4f, offset %.2f codes, from %d measurement%s.\n", c+1, ch[c].gain, ch[c].offset,
+			ch[c].n, ch[c].n == 1 ? "" : "s");
+	}
+	printf(" */\n\n");
+	printf("#define CAL_STEP_SHIFT\t%d\n", STEP_SHIFT);
+	printf("#define CAL_POINTS\t\t%d\n", POINTS);
+	printf("#define OHMS_OPEN\t\t0x%X\n\n", OHMS_OPEN);
+	for (c = 0; c < CHANNELS; c++)
+	{
+		printf("#define CAL_CH%d_RREF\t\t%ld\t\t//divider resistor (ohms)\n", c+1, lround(ch[c].rref));
+	}
+	for (c = 0; c < CHANNELS; c++)
+	{
+		printf("\nconst uint16_t cal_ohms_ch%d[CAL_POINTS] PROGMEM =\n{", c+1);
+		for (i = 0; i < POINTS; i++)
+		{
+			printf("%s%5u,", (i % 8) ? " " : "\n\t", table_point(&ch[c], i<<STEP_SHIFT));
+		}
+		printf("\n};\n");
+	}
+	return 0;
+}
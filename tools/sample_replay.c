@@ -0,0 +1,263 @@
+/*
+ * sample_replay.c
+ *
+ * Host tool: runs a recorded resistance trace through the firmware's adaptive
+ * sampler (sensor_core.h) and compares it with fixed-interval sampling: readings
+ * taken, and how far the last reported value (what the server shows) is from the
+ * real resistance over the trace.
+ *
+ *   gcc -O2 -I. -o sample_replay tools/sample_replay.c
+ *   ./sample_replay [-m min_s] [-M max_s] [-e ohms] [-s] trace.txt
+ *
+ * Trace: one "<seconds> <ohms>" per line (comma or space separated, # comments),
+ * times increasing; "open" or 65535 for an open contact.  Between points the
+ * resistance is taken as a straight line, and readings are quantized to the ADC
+ * steps of the pole 1 calibration table.  -e sets the error counted as stale
+ * (default 50 ohms), -s prints each adaptive reading as CSV instead of the summary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor_core.h"
+
+struct point
+{
+	uint32_t t;
+	uint16_t ohms;
+};
+
+struct result
+{
+	uint32_t readings;
+	uint32_t stale_s;		//seconds the reported value was off by more than the limit
+	double abs_err;			//sum over seconds of |reported - real|, open counts as stale only
+	uint16_t max_err;
+};
+
+static struct point *trace;
+static size_t n_points;
+
+//real resistance at t (t inside the trace)
+static uint16_t real_at(uint32_t t)
+{
+	static size_t i;
+	struct point *a, *b;
+
+	if (i && trace[i].t > t)
+	{
+		i = 0;
+	}
+	while (i + 1 < n_points && trace[i + 1].t <= t)
+	{
+		i++;
+	}
+	a = &trace[i];
+	if (i + 1 == n_points || a->ohms == OHMS_OPEN)
+	{
+		return a->ohms;
+	}
+	b = &trace[i + 1];
+	if (b->ohms == OHMS_OPEN)
+	{
+		return a->ohms;
+	}
+	return a->ohms + (int32_t)(b->ohms - a->ohms) * (int32_t)(t - a->t) / (int32_t)(b->t - a->t);
+}
+
+//what the ADC would read for it: the nearest step of the pole 1 table
+static uint16_t adc_reading(uint16_t ohms)
+{
+	uint16_t best = OHMS_OPEN, v;
+	unsigned code;
+
+	for (code = 0; code < 256 && ohms != OHMS_OPEN; code++)
+	{
+		v = adc_to_ohms(CAL_CH1, code);
+		if ((v > ohms ? v - ohms : ohms - v) < (best > ohms ? best - ohms : ohms - best))
+		{
+			best = v;
+		}
+	}
+	return best;
+}
+
+static void score(struct result *r, uint16_t shown, uint16_t real, uint16_t limit)
+{
+	uint16_t e;
+
+	if ((shown == OHMS_OPEN) != (real == OHMS_OPEN))
+	{
+		r->stale_s++;
+		return;
+	}
+	e = shown > real ? shown - real : real - shown;
+	r->abs_err += e;
+	if (e > r->max_err)
+	{
+		r->max_err = e;
+	}
+	if (e > limit)
+	{
+		r->stale_s++;
+	}
+}
+
+//interval 0: adaptive
+static struct result replay(uint16_t interval, uint16_t min_s, uint16_t max_s, uint16_t limit, uint8_t show)
+{
+	struct result r = {0};
+	struct sampler s;
+	uint32_t t, t0 = trace[0].t;
+	uint32_t next = t0;
+	uint16_t real, shown = 0;
+	uint8_t busy;
+
+	sampler_init(&s, min_s, max_s, t0);
+	for (t = t0; t <= trace[n_points - 1].t; t++)
+	{
+		real = real_at(t);
+		if (interval ? t >= next : sampler_due(&s, t))
+		{
+			shown = adc_reading(real);
+			r.readings++;
+			next = t + interval;
+			if (!interval)
+			{
+				busy = sampler_feed(&s, shown, t);
+				if (show)
+				{
+					printf("%lu,%u,%u,%d\n", (unsigned long)t, shown, s.interval_s, busy);
+				}
+			}
+		}
+		score(&r, shown, real, limit);
+	}
+	return r;
+}
+
+static void report(const char *name, struct result *r, uint32_t span)
+{
+	printf("%-22s %8lu %10.1f %9u %8.2f%%\n", name, (unsigned long)r->readings,
+		r->abs_err / span, r->max_err, 100.0 * r->stale_s / span);
+}
+
+static int load(const char *path)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	char line[128], *p;
+	size_t cap = 0;
+	unsigned long t;
+
+	if (!f)
+	{
+		perror(path);
+		return 0;
+	}
+	while (fgets(line, sizeof line, f))
+	{
+		if (line[0] == '#' || !strpbrk(line, "0123456789"))
+		{
+			continue;
+		}
+		if (n_points == cap)
+		{
+			cap = cap ? cap * 2 : 1024;
+			trace = realloc(trace, cap * sizeof *trace);
+			if (!trace)
+			{
+				perror("realloc");
+				return 0;
+			}
+		}
+		t = strtoul(line, &p, 10);
+		p += strspn(p, " \t,");
+		trace[n_points].t = t;
+		trace[n_points].ohms = strncmp(p, "open", 4) ? strtoul(p, 0, 10) : OHMS_OPEN;
+		if (n_points && t <= trace[n_points - 1].t)
+		{
+			fprintf(stderr, "%s: time goes backwards at %lu\n", path, t);
+			return 0;
+		}
+		n_points++;
+	}
+	if (f != stdin)
+	{
+		fclose(f);
+	}
+	if (n_points < 2)
+	{
+		fprintf(stderr, "%s: need at least two points\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned min_s = SAMPLE_MIN_S, max_s = SAMPLE_MAX_S, limit = 50;
+	int show = 0, i;
+	uint32_t span, same;
+	struct result adaptive, fast, slow, budget;
+	char name[32];
+
+	for (i = 1; i < argc - 1; i++)
+	{
+		if (!strcmp(argv[i], "-m"))
+		{
+			min_s = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-M"))
+		{
+			max_s = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-e"))
+		{
+			limit = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-s"))
+		{
+			show = 1;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (i != argc - 1 || !min_s || max_s < min_s || max_s > 65535)
+	{
+		fprintf(stderr, "usage: %s [-m min_s] [-M max_s] [-e ohms] [-s] trace.txt\n", argv[0]);
+		return 2;
+	}
+	if (!load(argv[i]))
+	{
+		return 1;
+	}
+	span = trace[n_points - 1].t - trace[0].t + 1;
+	if (show)
+	{
+		printf("time_s,reading_ohms,next_interval_s,busy\n");
+		replay(0, min_s, max_s, limit, 1);
+		return 0;
+	}
+
+	adaptive = replay(0, min_s, max_s, limit, 0);
+	fast = replay(min_s, min_s, max_s, limit, 0);
+	slow = replay(max_s, min_s, max_s, limit, 0);
+	same = span / (adaptive.readings ? adaptive.readings : 1);
+	budget = replay(same ? same : 1, min_s, max_s, limit, 0);
+
+	printf("%zu points over %lus, interval %u-%us, stale means off by more than %u ohms\n",
+		n_points, (unsigned long)span, min_s, max_s, limit);
+	printf("%-22s %8s %10s %9s %9s\n", "", "readings", "mean err", "max err", "stale");
+	report("adaptive", &adaptive, span);
+	snprintf(name, sizeof name, "fixed %us", min_s);
+	report(name, &fast, span);
+	snprintf(name, sizeof name, "fixed %lus (same n)", (unsigned long)(same ? same : 1));
+	report(name, &budget, span);
+	snprintf(name, sizeof name, "fixed %us", max_s);
+	report(name, &slow, span);
+	return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * sms_cmd_test.c
+ *
+ * Host test for SMS commands as the firmware takes them (sensor_core.h):
+ *   - the command text in AT+CMGR replies (sms_body(), what get_ctrl() returns), for
+ *     texts whose length field takes one, two and three digits, with and without the
+ *     command echo, and for an empty register;
+ *   - the arguments of I/J/K (read_parse()), O (sampler_parse()), P (schedule_parse())
+ *     and Q (pwr_parse()).
+ * Prints each case and exits 1 if any fails.
+ *
+ *   gcc -O2 -I. -o sms_cmd_test tools/sms_cmd_test.c
+ *   ./sms_cmd_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor_core.h"
+
+#define HEADER	"+CMGR: \"REC UNREAD\",\"+15551234567\",,\"26/10/19,12:00:00+00\",145,4,0,0,\"+15550000000\",145,"
+
+struct test
+{
+	const char *reply;
+	const char *text;		//what the main loop should see
+};
+
+static const struct test tests[] =
+{
+	{"\r\n" HEADER "1\r\nA\r\n\r\nOK\r\n", "A"},
+	{"\r\n" HEADER "3\r\nA;K\r\n\r\nOK\r\n", "A;K"},
+	{"\r\n" HEADER "10\r\nO1 30 3600\r\n\r\nOK\r\n", "O1 30 3600"},
+	{"\r\n" HEADER "13\r\nP1 900 0 6-22\r\n\r\nOK\r\n", "P1 900 0 6-22"},
+	{"\r\n" HEADER "10\r\nQgp 350000\r\n\r\nOK\r\n", "Qgp 350000"},
+	{"\r\n" HEADER "17\r\nI20@1000;K*@60000\r\n\r\nOK\r\n", "I20@1000;K*@60000"},
+	{"AT+CMGR=1\r\r\n" HEADER "13\r\nP2 900 30 6-22\r\n\r\nOK\r\n", "P2 900 30 6-22"},
+	{"\r\n" HEADER "120\r\nI;J;K;I;J;K;I;J;K;I;J;K\r\n\r\nOK\r\n", "I;J;K;I;J;K;I;J;K;I;J;K"},
+	{"\r\n" HEADER "7\r\nP1,900\r\n\r\nOK\r\n", "P1,900"},
+	{"AT+CMGR=1\r\r\nOK\r\n", ""},
+	{"", ""},
+};
+
+struct read_test
+{
+	const char *arg;		//after "I"
+	uint8_t ok;
+	uint16_t count;
+	uint32_t every_ms;
+};
+
+static const struct read_test read_tests[] =
+{
+	{"", 1, 1, 0},
+	{"20", 1, 20, 0},
+	{"20@1000", 1, 20, 1000},
+	{"*@60000", 1, READ_FOREVER, 60000},
+	{"*", 1, READ_FOREVER, 0},
+	{"0", 1, 0, 0},
+	{"@500", 1, 1, 500},
+	{" 20 ", 1, 20, 0},
+	{"65534", 1, 65534, 0},
+	{"5@86400000", 1, 5, 86400000},
+	{"65535", 0},					//would be READ_FOREVER
+	{"70000", 0},					//4464 once cut to 16 bits
+	{"20x", 0},
+	{"5@1000junk", 0},
+	{"5@", 0},
+	{"5@86400001", 0},
+	{"5@4294968296", 0},
+	{"*5", 0},
+	{"-3", 0},
+};
+
+static unsigned read_run(void)
+{
+	const struct read_test *t;
+	uint16_t count = 0;
+	uint32_t every = 0;
+	unsigned failed = 0;
+	uint8_t ok;
+
+	for (t = read_tests; t < read_tests + sizeof read_tests / sizeof read_tests[0]; t++)
+	{
+		ok = read_parse(t->arg, &count, &every);
+		if (ok != t->ok || (ok && (count != t->count || every != t->every_ms)))
+		{
+			failed++;
+			printf("FAIL ");
+		}
+		else
+		{
+			printf("ok   ");
+		}
+		if (ok)
+		{
+			printf("I%s -> %u every %lums\n", t->arg, count, (unsigned long)every);
+		}
+		else
+		{
+			printf("I%s -> rejected\n", t->arg);
+		}
+	}
+	return failed;
+}
+
+struct sampler_test
+{
+	const char *arg;		//after "O<pole>"
+	uint8_t ok;
+	uint16_t min_s, max_s;
+};
+
+static const struct sampler_test sampler_tests[] =
+{
+	{" 30 3600", 1, 30, 3600},
+	{" 10 900", 1, 10, 900},
+	{" 60 60", 1, 60, 60},
+	{" 1 65535 ", 1, 1, 65535},
+	{" 30", 0},
+	{"", 0},
+	{" 0 900", 0},
+	{" 900 30", 0},
+	{" 30 65536", 0},
+	{" 30 69536", 0},				//4000 once cut to 16 bits
+	{" 30 3600 7", 0},
+	{" 30 3600s", 0},
+};
+
+static unsigned sampler_run(void)
+{
+	const struct sampler_test *t;
+	uint16_t lo = 0, hi = 0;
+	unsigned failed = 0;
+	uint8_t ok;
+
+	for (t = sampler_tests; t < sampler_tests + sizeof sampler_tests / sizeof sampler_tests[0]; t++)
+	{
+		ok = sampler_parse(t->arg, &lo, &hi);
+		if (ok != t->ok || (ok && (lo != t->min_s || hi != t->max_s)))
+		{
+			failed++;
+			printf("FAIL ");
+		}
+		else
+		{
+			printf("ok   ");
+		}
+		if (ok)
+		{
+			printf("O1%s -> %u-%us\n", t->arg, lo, hi);
+		}
+		else
+		{
+			printf("O1%s -> rejected\n", t->arg);
+		}
+	}
+	return failed;
+}
+
+struct schedule_test
+{
+	const char *arg;		//after "P<pole>"
+	uint8_t ok;
+	struct schedule s;
+};
+
+static const struct schedule_test schedule_tests[] =
+{
+	{" 900 0 6-22", 1, {900, 0, 6, 22}},
+	{" 900 30 6-22", 1, {900, 30, 6, 22}},
+	{" 900 30 22-6", 1, {900, 30, 22, 6}},
+	{" 3600", 1, {3600, 0, 0, 0}},
+	{" 3600 60", 1, {3600, 60, 0, 0}},
+	{" 3600 60 7", 1, {3600, 60, 7, 7}},
+	{" 0", 1, {0, 0, 0, 0}},
+	{" 900 0 6-22  ", 1, {900, 0, 6, 22}},
+	{"", 0},
+	{" 900 900", 0},
+	{" 43201", 0},
+	{" 66436", 0},					//900 once cut to 16 bits
+	{" 4294968196", 0},				//900 once cut to 32 bits
+	{" 900 0 262-22", 0},
+	{" 900 0 6-24", 0},
+	{" 900 0 6to22", 0},
+	{" 900 0 6-", 0},
+	{" 900 -30", 0},
+	{" 900x", 0},
+};
+
+static unsigned schedule_run(void)
+{
+	const struct schedule_test *t;
+	struct schedule s;
+	unsigned failed = 0;
+	uint8_t ok;
+
+	for (t = schedule_tests; t < schedule_tests + sizeof schedule_tests / sizeof schedule_tests[0]; t++)
+	{
+		memset(&s, 0, sizeof s);
+		ok = schedule_parse(&s, t->arg);
+		if (ok != t->ok || (ok && memcmp(&s, &t->s, sizeof s)))
+		{
+			failed++;
+			printf("FAIL ");
+		}
+		else
+		{
+			printf("ok   ");
+		}
+		printf("P1%s -> %s", t->arg, ok ? "" : "rejected\n");
+		if (ok)
+		{
+			printf("every %u phase %u %u-%u\n", s.every_s, s.phase_s, s.from_h, s.to_h);
+		}
+	}
+	return failed;
+}
+
+struct pwr_test
+{
+	const char *arg;		//after "Q"
+	uint8_t ok;
+	uint8_t state;
+	uint32_t ua;
+};
+
+static const struct pwr_test pwr_tests[] =
+{
+	{"gp 350000", 1, PWR_GPRS, 350000},
+	{"mo 25000", 1, PWR_MODEM, 25000},
+	{" id 4500 ", 1, PWR_IDLE, 4500},
+	{"ac13000", 1, PWR_ACTIVE, 13000},
+	{"ms 0", 1, PWR_MODEM_SLEEP, 0},
+	{"gp 700000", 1, PWR_GPRS, 700000},
+	{"gp 700001", 0},
+	{"gp", 0},
+	{"gp x", 0},
+	{"gp 350000mA", 0},
+	{"sl 10", 0},					//no MCU sleep state
+	{"zz 10", 0},
+	{"g", 0},
+};
+
+static unsigned pwr_run(void)
+{
+	const struct pwr_test *t;
+	uint32_t ua = 0;
+	unsigned failed = 0;
+	uint8_t ok, state = 0;
+
+	for (t = pwr_tests; t < pwr_tests + sizeof pwr_tests / sizeof pwr_tests[0]; t++)
+	{
+		ok = pwr_parse(t->arg, &state, &ua);
+		if (ok != t->ok || (ok && (state != t->state || ua != t->ua)))
+		{
+			failed++;
+			printf("FAIL ");
+		}
+		else
+		{
+			printf("ok   ");
+		}
+		if (ok)
+		{
+			printf("Q%s -> state %u %luuA\n", t->arg, state, (unsigned long)ua);
+		}
+		else
+		{
+			printf("Q%s -> rejected\n", t->arg);
+		}
+	}
+	return failed;
+}
+
+//a long gap in one energy_add() must charge what the same time does a second at a time
+static const uint32_t gap_ms[] = {1500, 60000, 61000, 600000, 4000000};
+
+static unsigned energy_run(void)
+{
+	struct energy one, many;
+	uint32_t ms;
+	unsigned i, failed = 0;
+	uint8_t ok;
+
+	for (i = 0; i < sizeof gap_ms / sizeof gap_ms[0]; i++)
+	{
+		energy_init(&one);
+		energy_init(&many);
+		one.ua[PWR_GPRS] = many.ua[PWR_GPRS] = PWR_UA_MAX;
+		energy_add(&one, PWR_GPRS, gap_ms[i] * 1000 + 250);
+		for (ms = gap_ms[i]; ms; ms -= ms < 1000 ? ms : 1000)
+		{
+			energy_add(&many, PWR_GPRS, (ms < 1000 ? ms : 1000) * 1000);
+		}
+		energy_add(&many, PWR_GPRS, 250);
+		ok = one.uah[PWR_GPRS] == many.uah[PWR_GPRS] && one.rem[PWR_GPRS] == many.rem[PWR_GPRS]
+			&& one.nah == many.nah && one.us[PWR_GPRS] == many.us[PWR_GPRS];
+		if (!ok)
+		{
+			failed++;
+		}
+		printf("%-4s %lums at %luuA -> %luuAh\n", ok ? "ok" : "FAIL", (unsigned long)gap_ms[i],
+			(unsigned long)PWR_UA_MAX, (unsigned long)one.uah[PWR_GPRS]);
+	}
+	return failed;
+}
+
+int main(void)
+{
+	char text[48];
+	const char *body;
+	unsigned i, failed = 0, n;
+
+	for (i = 0; i < sizeof tests / sizeof tests[0]; i++)
+	{
+		body = sms_body(tests[i].reply);
+		strncpy(text, body, sizeof text - 1);		//as the main loop takes it
+		text[sizeof text - 1] = '\0';
+		text[strcspn(text, "\r\n")] = '\0';
+		if (strcmp(text, tests[i].text))
+		{
+			failed++;
+		}
+		printf("%-4s \"%s\" -> \"%s\"\n", strcmp(text, tests[i].text) ? "FAIL" : "ok", tests[i].text, text);
+	}
+	n = i;
+	failed += read_run();
+	n += sizeof read_tests / sizeof read_tests[0];
+	failed += sampler_run();
+	n += sizeof sampler_tests / sizeof sampler_tests[0];
+	failed += schedule_run();
+	n += sizeof schedule_tests / sizeof schedule_tests[0];
+	failed += pwr_run();
+	n += sizeof pwr_tests / sizeof pwr_tests[0];
+	failed += energy_run();
+	n += sizeof gap_ms / sizeof gap_ms[0];
+	printf("%u of %u failed\n", failed, n);
+	return failed != 0;
+}
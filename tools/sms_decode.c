@@ -0,0 +1,156 @@
+/*
+ * sms_decode.c
+ *
+ * Host tool: turns the packed SMS the firmware sends while GPRS is down back
+ * into the posts they stand for, as CSV: seq,time,endpoint,value
+ *
+ *   gcc -O2 -I. -o sms_decode tools/sms_decode.c
+ *   ./sms_decode texts.txt > posts.csv
+ *
+ * One text per line (- for stdin).  time is UTC seconds, or "-<seconds>" before
+ * the text was sent when the device clock hadn't synced.  value is ohms (open for
+ * an open contact) on /data1 and /data2, true/false on the status endpoints.
+ * Gaps in the sequence numbers (lost texts) are reported on stderr.
+ *
+ * Text (see sms_pack_add() in sensor_core.h): 'P' or 'Q', sequence number, time
+ * of the first record, then <endpoint> <time change> <value change> per record,
+ * all varints of 5 bits per character with 32 set on all but the last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sensor_core.h"
+
+//varint at *p, -1 on a bad character or a truncated text
+static long get(const char **p)
+{
+	const char *c;
+	unsigned long v = 0;
+	unsigned shift = 0;
+	int d;
+
+	do
+	{
+		c = **p ? strchr(sms_alphabet, **p) : 0;
+		if (!c || shift > 30)
+		{
+			return -1;
+		}
+		d = c - sms_alphabet;
+		v |= (unsigned long)(d & 31) << shift;
+		shift += 5;
+		(*p)++;
+	}
+	while (d & 32);
+	return v;
+}
+
+static long unzigzag(long z)
+{
+	return z & 1 ? -((z + 1) >> 1) : z >> 1;
+}
+
+static int decode(const char *text, long *expect)
+{
+	const char *p = text + 1;
+	long seq, base, ep, dt, dv;
+	long t = 0;
+	long value[EP_COUNT] = {0};
+	int epoch = text[0] == 'P';
+
+	if (text[0] != 'P' && text[0] != 'Q')
+	{
+		return 0;
+	}
+	seq = get(&p);
+	base = get(&p);
+	if (seq < 0 || base < 0)
+	{
+		return 0;
+	}
+	if (*expect >= 0 && seq != *expect)
+	{
+		fprintf(stderr, "texts %ld to %ld missing\n", *expect, (seq - 1) & SMS_SEQ_MASK);
+	}
+	*expect = (seq + 1) & SMS_SEQ_MASK;
+	while (*p)
+	{
+		ep = get(&p);
+		dt = get(&p);
+		dv = get(&p);
+		if (ep < 0 || ep >= EP_COUNT || dt < 0 || dv < 0)
+		{
+			return 0;
+		}
+		t += unzigzag(dt);
+		value[ep] += unzigzag(dv);
+		printf("%ld,", seq);
+		if (epoch)
+		{
+			printf("%ld,", base + t);
+		}
+		else
+		{
+			printf("-%ld,", base - t);
+		}
+		printf("%s,", endpoint_path[ep]);
+		if (ep == EP_DATA1 || ep == EP_DATA2)
+		{
+			if (value[ep] == OHMS_OPEN)
+			{
+				printf("open\n");
+			}
+			else
+			{
+				printf("%ld\n", value[ep]);
+			}
+		}
+		else if (ep == EP_BAD1 || ep == EP_BAD2)
+		{
+			printf("%ld\n", value[ep]);
+		}
+		else
+		{
+			printf("%s\n", value[ep] ? "true" : "false");
+		}
+	}
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	char line[512];
+	long expect = -1;
+	size_t len;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <texts>\n", argv[0]);
+		return 2;
+	}
+	f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
+	if (!f)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	printf("seq,time,endpoint,value\n");
+	while (fgets(line, sizeof line, f))
+	{
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (!len || line[0] == '#')
+		{
+			continue;
+		}
+		if (!decode(line, &expect))
+		{
+			fprintf(stderr, "not a packed text: %s\n", line);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# sram_report.sh
+#
+# Build-time SRAM report: lists every .data/.bss symbol of the firmware ELF
+# against the budgets in tools/sram_budget.txt and exits non-zero on overrun.
+#
+#   tools/sram_report.sh Analog_Sensor.elf [budget file]
+#
+# NM defaults to avr-nm; RAM_SIZE defaults to the ATmega32U4's 2560 bytes.
+
+ELF=${1:?usage: $0 <elf> [budget file]}
+BUDGET=${2:-$(dirname "$0")/sram_budget.txt}
+NM=${NM:-avr-nm}
+RAM_SIZE=${RAM_SIZE:-2560}
+
+"$NM" -S -t d --size-sort "$ELF" | awk -v budget="$BUDGET" -v ram="$RAM_SIZE" '
+BEGIN {
+	while ((getline line < budget) > 0) {
+		sub(/#.*/, "", line)
+		if (split(line, f) >= 2)
+			cap[f[1]] = f[2] + 0
+	}
+	fail = 0
+}
+# address size type name; .data is d/D, .bss is b/B
+NF >= 4 && $3 ~ /^[bBdD]$/ {
+	size = $2 + 0
+	sect = ($3 ~ /[dD]/) ? ".data" : ".bss"
+	total[sect] += size
+	limit = ($4 in cap) ? cap[$4] : cap["*"]
+	flag = ""
+	if (limit != "" && size > limit) {
+		flag = "  OVER (budget " limit ")"
+		fail = 1
+	}
+	printf "%-6s %6d  %s%s\n", sect, size, $4, flag
+}
+END {
+	used = total[".data"] + total[".bss"]
+	printf "\n.data %d  .bss %d  static %d of %d bytes, %d left for stack\n", \
+		total[".data"], total[".bss"], used, ram, ram - used
+	if (("total" in cap) && used > cap["total"]) {
+		printf "static RAM over budget (%d > %d)\n", used, cap["total"]
+		fail = 1
+	}
+	if (("stack" in cap) && ram - used < cap["stack"]) {
+		printf "stack reserve under budget (%d < %d)\n", ram - used, cap["stack"]
+		fail = 1
+	}
+	exit fail
+}'
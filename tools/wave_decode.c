@@ -0,0 +1,78 @@
+/*
+ * wave_decode.c
+ *
+ * Host tool: reconstructs a burst capture posted to /wave1 or /wave2
+ * (SMS commands M and N) and prints it as CSV: time_us,adc_code,ohms
+ *
+ *   gcc -O2 -I. -o wave_decode tools/wave_decode.c
+ *   ./wave_decode payload.bin > wave.csv
+ *
+ * Payload (see wave_encode() in sensor_core.h):
+ *   'W' <pole '1'/'2'> <rate Hz, 2 bytes LE> <samples, 2 bytes LE>
+ *   then one varint per sample: the zigzagged difference from the previous
+ *   sample (the first from 0), 7 bits per byte, high bit set on all but the last.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sensor_core.h"
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	unsigned char head[6];
+	unsigned rate, count, i, z, shift;
+	int c, pole, value = 0;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <payload>\n", argv[0]);
+		return 2;
+	}
+	f = fopen(argv[1], "rb");
+	if (!f)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(head, 1, sizeof head, f) != sizeof head || head[0] != 'W')
+	{
+		fprintf(stderr, "%s: not a capture\n", argv[1]);
+		return 1;
+	}
+	pole = head[1] - '0';
+	rate = head[2] | head[3] << 8;
+	count = head[4] | head[5] << 8;
+	if (!rate)
+	{
+		fprintf(stderr, "%s: bad rate\n", argv[1]);
+		return 1;
+	}
+	printf("# pole %d, %u samples at %u Hz\ntime_us,adc_code,ohms\n", pole, count, rate);
+	for (i = 0; i < count; i++)
+	{
+		z = 0;
+		shift = 0;
+		do
+		{
+			c = getc(f);
+			if (c == EOF)
+			{
+				fprintf(stderr, "%s: truncated at sample %u\n", argv[1], i);
+				return 1;
+			}
+			z |= (unsigned)(c & 0x7F) << shift;
+			shift += 7;
+		} while (c & 0x80);
+		value += (z & 1) ? -(int)((z + 1) >> 1) : (int)(z >> 1);
+		if (value < 0 || value > 255)
+		{
+			fprintf(stderr, "%s: sample %u out of range\n", argv[1], i);
+			return 1;
+		}
+		printf("%lu,%d,%u\n", (unsigned long)i * 1000000UL / rate, value, adc_to_ohms(pole == 2 ? CAL_CH2 : CAL_CH1, value));
+	}
+	fclose(f);
+	return 0;
+}